@@ -0,0 +1,78 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "aggr.h"
+#include "common.h"
+
+struct aggr *aggr_new(const char *pattern)
+{
+	struct aggr *aggr;
+
+	aggr = malloc(sizeof(*aggr));
+	if (!aggr)
+		mylog(LOG_ERR, "malloc aggr: %s", ESTR(errno));
+	memset(aggr, 0, sizeof(*aggr));
+	aggr->pattern = strdup(pattern);
+	return aggr;
+}
+
+void aggr_free(struct aggr *aggr)
+{
+	free(aggr->pattern);
+	if (aggr->vals)
+		free(aggr->vals);
+	free(aggr);
+}
+
+void aggr_reset(struct aggr *aggr)
+{
+	memset(&aggr->v, 0, sizeof(aggr->v));
+}
+
+static int dblcmp(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da < db) ? -1 : (da > db) ? 1 : 0;
+}
+
+int aggr_add_value(struct aggr *aggr, int numeric, double num, int add)
+{
+	double *pos;
+	int idx;
+
+	if (add < 0 && numeric) {
+		/* test first, keep the counters consistent */
+		pos = bsearch(&num, aggr->vals, aggr->v.nnum, sizeof(*aggr->vals), dblcmp);
+		if (!pos)
+			return -1;
+		idx = pos - aggr->vals;
+		aggr->v.nnum -= 1;
+		memmove(aggr->vals+idx, aggr->vals+idx+1, sizeof(*aggr->vals)*(aggr->v.nnum-idx));
+		/* avoid accumulating rounding errors */
+		aggr->v.sum = aggr->v.nnum ? aggr->v.sum - num : 0;
+	} else if (numeric) {
+		if (aggr->v.nnum >= aggr->svals) {
+			aggr->svals = aggr->svals*2 ?: 16;
+			aggr->vals = realloc(aggr->vals, sizeof(*aggr->vals)*aggr->svals);
+			if (!aggr->vals)
+				mylog(LOG_ERR, "realloc %i: %s", aggr->svals, ESTR(errno));
+		}
+		/* insert sorted */
+		for (idx = aggr->v.nnum; idx > 0 && aggr->vals[idx-1] > num; --idx);
+		memmove(aggr->vals+idx+1, aggr->vals+idx, sizeof(*aggr->vals)*(aggr->v.nnum-idx));
+		aggr->vals[idx] = num;
+		aggr->v.nnum += 1;
+		aggr->v.sum += num;
+	}
+	aggr->v.nmembers += add;
+	if (numeric && num != 0)
+		aggr->v.ntrue += add;
+	if (aggr->v.nnum) {
+		aggr->v.min = aggr->vals[0];
+		aggr->v.max = aggr->vals[aggr->v.nnum-1];
+	}
+	return 0;
+}
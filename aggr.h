@@ -0,0 +1,36 @@
+#ifndef _aggr_h_
+#define _aggr_h_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "rpnlogic.h"
+
+/* wildcard aggregate
+ * The owner feeds the values of the matching topics,
+ * the operators read v.
+ */
+struct aggr {
+	char *pattern;
+	int ref;
+	struct rpn_aggr v;
+	/* sorted numeric member values, for min & max */
+	double *vals;
+	int svals;
+};
+
+extern struct aggr *aggr_new(const char *pattern);
+extern void aggr_free(struct aggr *);
+
+/* forget all members */
+extern void aggr_reset(struct aggr *);
+
+/* add (or remove when @add < 0) a member with value @num,
+ * return < 0 when a removed value was not present
+ */
+extern int aggr_add_value(struct aggr *, int numeric, double num, int add);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,4 +1,5 @@
 #include <math.h>
+#include <stdlib.h>
 #include <time.h>
 
 #include "astronomics.h"
@@ -27,30 +28,47 @@ time_t toepoch(double julianday)
 	return (julianday - J2000)*86400 + t_1jan2000_12h;
 }
 
-struct sunpos sun_pos_strous(time_t t, double lat, double lon)
-{
-	/* https://www.aa.quae.nl/en/reken/zonpositie.html */
+/* https://www.aa.quae.nl/en/reken/zonpositie.html
+ * The computation is split by how fast its terms change,
+ * so sun_pos_cached() can reuse the slow ones.
+ */
+#define M0 357.5291
+#define M1 0.98560028
+#define majorPI 102.9373
+#define epsilon 23.4393
+#define J0 0.0009
+#define J1 0.0053
+#define J2 -0.0068
+#define J3 1.0
+#define h0 -0.83
 
-	/* julian day relative to 1jan2000,12h */
-	double J = (t - t_1jan2000_12h)/86400.0 + 0.0008;
+/* julian day relative to 1jan2000,12h */
+static inline double strous_J(time_t t)
+{
+	return (t - t_1jan2000_12h)/86400.0 + 0.0008;
+}
 
+/* equatorial coordinates: right ascension & declination */
+static void sun_equatorial(double J, double *palpha, double *pdelta)
+{
 	/* mean anomaly of the sun */
 	/* M = M0 + M1 * (J-J2000) */
-#define M0 357.5291
-#define M1 0.98560028
 	double M = fmod(M0 + M1 * J, 360);
 
 	/* Equation of Center */
 	double C = 1.9148*sin(torad(M)) + 0.0200*sin(torad(2*M)) + 0.0003*sin(torad(3*M));
 
 	/* Ecliptic longitude & obliquity */
-#define majorPI 102.9373
 	double lambda = M + majorPI + C + 180;
 
-	#define epsilon 23.4393
-	double alpha = todeg(atan2(sin(torad(lambda))*cos(torad(epsilon)), cos(torad(lambda))));
-	double delta = todeg(asin(sin(torad(lambda))*sin(torad(epsilon))));
+	*palpha = todeg(atan2(sin(torad(lambda))*cos(torad(epsilon)), cos(torad(lambda))));
+	*pdelta = todeg(asin(sin(torad(lambda))*sin(torad(epsilon))));
+}
 
+/* elevation & azimuth */
+static void sun_horizontal(double J, double lat, double lon, double alpha, double delta,
+		struct sunpos *result)
+{
 	/* sidereal time */
 	double theta = fmod(280.1470 + 360.9856235 * J + lon, 360);
 
@@ -62,29 +80,195 @@ struct sunpos sun_pos_strous(time_t t, double lat, double lon)
 	/* azimuth */
 	double az = atan2(sin(torad(H)), cos(torad(H))*sin(torad(lat)) - tan(torad(delta))*cos(torad(lat)));
 
-	struct sunpos result = {
-		.elevation = todeg(alt),
-		.azimuth = fmod(todeg(az)+180, 360),
-	};
+	result->elevation = todeg(alt);
+	result->azimuth = fmod(todeg(az)+180, 360);
+}
 
-#define J0 0.0009
-#define J1 0.0053
-#define J2 -0.0068
-#define J3 1.0
+/* sunrise, sunset & noon */
+static void sun_daily(time_t t, double J, double lat, double lon, double delta,
+		struct sunpos *result)
+{
 	double nx = (J - J0)/J3 + lon/360;
 	double Jx = J + J3 * -fmod(nx, 1);
 	double Mx = fmod(M0 + M1 * Jx, 360);
 	double Lsunx = Mx + majorPI + 180;
 	double Jtransit = Jx + J1*sin(torad(Mx))+J2*sin(torad(2*Lsunx));
-#define h0 -0.83
 
 	double Ht = acos((sin(torad(h0))-sin(torad(lat))*sin(torad(delta)))/(cos(torad(lat))*cos(torad(delta))));
 	double Jrise = Jtransit - (todeg(Ht)/360)*J3;
 	double Jset = Jtransit + (todeg(Ht)/360)*J3;
 
-	result.sunnoon = t + (Jtransit-J)*86400;
-	result.sunrise = t + (Jrise-J)*86400;
-	result.sunset = t + (Jset-J)*86400;
+	result->sunnoon = t + (Jtransit-J)*86400;
+	result->sunrise = t + (Jrise-J)*86400;
+	result->sunset = t + (Jset-J)*86400;
+}
 
+struct sunpos sun_pos_strous(time_t t, double lat, double lon)
+{
+	struct sunpos result = {};
+	double J = strous_J(t);
+	double alpha, delta;
+
+	sun_equatorial(J, &alpha, &delta);
+	sun_horizontal(J, lat, lon, alpha, delta, &result);
+	sun_daily(t, J, lat, lon, delta, &result);
 	return result;
 }
+
+/* hour angle, 0..360 degrees */
+static inline double sun_hourangle(double J, double lon, double alpha)
+{
+	double H = fmod(280.1470 + 360.9856235 * J + lon - alpha, 360);
+
+	return H < 0 ? H + 360 : H;
+}
+
+/* the hour angle grows this many degrees per day,
+ * sidereal rate minus the sun's own motion
+ */
+#define HOURANGLE_RATE	360.0
+
+/* hour angle where the elevation equals @elv, NAN if it never does */
+static double sun_crossing_hourangle(double lat, double delta, double elv, int rising)
+{
+	double c = (sin(torad(elv)) - sin(torad(lat))*sin(torad(delta)))/(cos(torad(lat))*cos(torad(delta)));
+
+	if (!(c > -1 && c < 1))
+		return NAN;
+	/* rising before, setting after the transit */
+	return rising ? 360 - todeg(acos(c)) : todeg(acos(c));
+}
+
+/* move @J onto the crossing, with the declination of that moment */
+static double sun_refine_crossing(double J, double lat, double lon, double elv, int rising)
+{
+	double alpha, delta, Ht, dJ;
+	int j;
+
+	for (j = 0; j < 5; ++j) {
+		sun_equatorial(J, &alpha, &delta);
+		Ht = sun_crossing_hourangle(lat, delta, elv, rising);
+		if (isnan(Ht))
+			return NAN;
+		dJ = remainder(Ht - sun_hourangle(J, lon, alpha), 360)/HOURANGLE_RATE;
+		J += dJ;
+		if (fabs(dJ) < 0.1/86400)
+			break;
+	}
+	return J;
+}
+
+static double sun_elevation(time_t t, double lat, double lon)
+{
+	struct sunpos pos;
+	double J = strous_J(t);
+	double alpha, delta;
+
+	sun_equatorial(J, &alpha, &delta);
+	sun_horizontal(J, lat, lon, alpha, delta, &pos);
+	return pos.elevation;
+}
+
+/* the solution above can land on the 2nd of 2 close crossings
+ * when the sun barely passes elv, i.e. near the polar day.
+ * Sample the elevation up to @next, and bisect where it changes first.
+ */
+#define CROSSING_STEP	600
+
+static time_t sun_first_crossing(time_t t, time_t next, double lat, double lon, double elv)
+{
+	int above = sun_elevation(t, lat, lon) > elv;
+	time_t lo, hi, mid;
+
+	for (lo = t, hi = t + CROSSING_STEP; hi < next; lo = hi, hi += CROSSING_STEP) {
+		if ((sun_elevation(hi, lat, lon) > elv) == above)
+			continue;
+		while (hi - lo > 1) {
+			mid = lo + (hi - lo)/2;
+			if ((sun_elevation(mid, lat, lon) > elv) == above)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		return hi;
+	}
+	return next;
+}
+
+time_t sun_next_crossing(time_t t, double lat, double lon, double elv)
+{
+	double J = strous_J(t);
+	double alpha, delta, Ht, Jc, best = NAN;
+	int rising;
+
+	sun_equatorial(J, &alpha, &delta);
+	for (rising = 0; rising < 2; ++rising) {
+		Ht = sun_crossing_hourangle(lat, delta, elv, rising);
+		if (isnan(Ht))
+			/* sun stays above or below, retry in the refinement */
+			Ht = rising ? 270 : 90;
+		/* first guess, ahead of t */
+		Jc = J + fmod(Ht - sun_hourangle(J, lon, alpha) + 360, 360)/HOURANGLE_RATE;
+		Jc = sun_refine_crossing(Jc, lat, lon, elv, rising);
+		if (Jc <= J)
+			/* refined into the past, take the next day */
+			Jc = sun_refine_crossing(Jc + 1, lat, lon, elv, rising);
+		if (Jc > J && (isnan(best) || Jc < best))
+			best = Jc;
+	}
+	if (isnan(best))
+		return sun_first_crossing(t, t + SUN_NOCROSSING_RETRY, lat, lon, elv);
+	return sun_first_crossing(t, t + (time_t)ceil((best - J)*86400), lat, lon, elv);
+}
+
+/* cache per location
+ * - elevation & azimuth are reused within the same second
+ * - right ascension & declination change less than 0.01 degree
+ *   in SUN_EQU_PERIOD, and are reused for that long
+ * The result depends on the cache state, so pure operators
+ * must not use it. The cache is per thread.
+ */
+#define NSUNCACHE	4
+#define SUN_EQU_PERIOD	600
+
+static __thread struct suncache {
+	double lat, lon;
+	int valid;
+	time_t t; /* of pos */
+	time_t tequ; /* of alpha & delta */
+	double alpha, delta;
+	struct sunpos pos;
+} suncache[NSUNCACHE];
+static __thread int nextsuncache;
+
+struct sunpos sun_pos_cached(time_t t, double lat, double lon)
+{
+	struct suncache *c;
+	double J;
+	int j;
+
+	for (j = 0; j < NSUNCACHE; ++j) {
+		c = suncache+j;
+		if (c->valid && c->lat == lat && c->lon == lon)
+			break;
+	}
+	if (j >= NSUNCACHE) {
+		c = suncache+nextsuncache;
+		nextsuncache = (nextsuncache+1) % NSUNCACHE;
+		c->lat = lat;
+		c->lon = lon;
+		c->valid = 0;
+	}
+	if (c->valid && c->t == t)
+		return c->pos;
+
+	J = strous_J(t);
+	if (!c->valid || labs(t - c->tequ) >= SUN_EQU_PERIOD) {
+		sun_equatorial(J, &c->alpha, &c->delta);
+		c->tequ = t;
+	}
+	sun_horizontal(J, lat, lon, c->alpha, c->delta, &c->pos);
+	c->t = t;
+	c->valid = 1;
+	return c->pos;
+}
@@ -15,6 +15,17 @@ struct sunpos {
 };
 
 extern struct sunpos sun_pos_strous(time_t t, double lat, double lon);
+/* elevation & azimuth only, with reuse of slow changing terms
+ * per location. This may differ 0.01 degree from sun_pos_strous.
+ */
+extern struct sunpos sun_pos_cached(time_t t, double lat, double lon);
+
+/* first time after @t when the elevation crosses @elv.
+ * When it does not cross within a day, t + SUN_NOCROSSING_RETRY
+ * is returned, to try again then.
+ */
+#define SUN_NOCROSSING_RETRY	3600
+extern time_t sun_next_crossing(time_t t, double lat, double lon, double elv);
 
 extern double julian_day(time_t t);
 extern time_t toepoch(double julian);
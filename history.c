@@ -0,0 +1,318 @@
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "history.h"
+#include "common.h"
+
+/* The arena is cut in blocks of HBLOCK bytes.
+ * Each block holds samples of 1 history in 2 columns:
+ * - the time column grows from the front, as varint of the delta
+ *   in msec to the previous sample.
+ * - the value column grows from the back, as the significant bytes
+ *   of the XOR with the previous value.
+ * Blocks are recycled round-robin, which always takes the oldest
+ * block of its owner.
+ */
+#define HBLOCK	128
+
+struct hblock {
+	struct history *owner;
+	int next; /* next block of owner, -1 for none */
+	int nsamples;
+	int tlen, vlen; /* used bytes of time & value column */
+	double t0; /* time of first sample */
+	/* last sample, reference for the next one */
+	uint64_t tlast; /* msec since t0 */
+	uint64_t vlast; /* raw bits */
+};
+
+struct history {
+	int head, tail; /* oldest & newest block */
+};
+
+static uint8_t *arena;
+static struct hblock *blocks;
+static int nblocks;
+static int nextblock; /* next block to recycle */
+
+void history_init(long size)
+{
+	int j;
+
+	nblocks = size / HBLOCK;
+	if (!nblocks) {
+		/* ago & integral will yield nan */
+		mylog(size ? LOG_WARNING : LOG_NOTICE, "history of %li bytes is disabled", size);
+		return;
+	}
+	arena = malloc(nblocks*HBLOCK);
+	blocks = malloc(sizeof(*blocks)*nblocks);
+	if (!arena || !blocks)
+		mylog(LOG_ERR, "malloc history %li: %s", size, ESTR(errno));
+	memset(blocks, 0, sizeof(*blocks)*nblocks);
+	for (j = 0; j < nblocks; ++j)
+		blocks[j].next = -1;
+}
+
+struct history *history_new(void)
+{
+	struct history *h;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		mylog(LOG_ERR, "malloc history: %s", ESTR(errno));
+	h->head = h->tail = -1;
+	return h;
+}
+
+void history_free(struct history *h)
+{
+	int j;
+
+	if (!h)
+		return;
+	for (j = h->head; j >= 0; j = blocks[j].next)
+		blocks[j].owner = NULL;
+	free(h);
+}
+
+/* encoding */
+static inline uint64_t dbltobits(double d)
+{
+	union { double d; uint64_t u; } x = { .d = d, };
+
+	return x.u;
+}
+
+static inline double bitstodbl(uint64_t u)
+{
+	union { double d; uint64_t u; } x = { .u = u, };
+
+	return x.d;
+}
+
+static int put_varint(uint8_t *dst, uint64_t val)
+{
+	int len = 0;
+
+	do {
+		dst[len++] = (val & 0x7f) | ((val > 0x7f) ? 0x80 : 0);
+		val >>= 7;
+	} while (val);
+	return len;
+}
+
+static int get_varint(const uint8_t *src, uint64_t *pval)
+{
+	uint64_t val = 0;
+	int len = 0;
+
+	do {
+		val |= (uint64_t)(src[len] & 0x7f) << (7*len);
+	} while (src[len++] & 0x80);
+	*pval = val;
+	return len;
+}
+
+/* store the significant bytes of @x, followed by a control byte
+ * with the number of trailing zero bytes & the number of bytes
+ */
+static int put_value(uint8_t *dst, uint64_t x)
+{
+	int tz, n, j;
+
+	if (!x) {
+		dst[0] = 0;
+		return 1;
+	}
+	tz = __builtin_ctzll(x) / 8;
+	n = 8 - __builtin_clzll(x) / 8 - tz;
+	x >>= 8*tz;
+	for (j = 0; j < n; ++j)
+		dst[j] = x >> (8*j);
+	dst[n] = (tz << 4) | n;
+	return n+1;
+}
+
+/* decode the value that ends at @end */
+static int get_value(const uint8_t *data, int end, uint64_t *px)
+{
+	int ctrl = data[end-1];
+	int n = ctrl & 0xf, j;
+	uint64_t x = 0;
+
+	for (j = 0; j < n; ++j)
+		x |= (uint64_t)data[end-1-n+j] << (8*j);
+	*px = x << (8*(ctrl >> 4));
+	return n+1;
+}
+
+static struct hblock *history_grow(struct history *h, double t)
+{
+	struct hblock *b;
+	int idx;
+
+	idx = nextblock;
+	nextblock = (nextblock+1) % nblocks;
+	b = blocks+idx;
+	if (b->owner) {
+		/* recycle the oldest block of its owner */
+		b->owner->head = b->next;
+		if (b->owner->head < 0)
+			b->owner->tail = -1;
+	}
+	memset(b, 0, sizeof(*b));
+	b->owner = h;
+	b->next = -1;
+	b->t0 = t;
+
+	if (h->tail >= 0)
+		blocks[h->tail].next = idx;
+	else
+		h->head = idx;
+	h->tail = idx;
+	return b;
+}
+
+void history_add(struct history *h, double t, double value)
+{
+	struct hblock *b;
+	uint8_t tbuf[10], vbuf[9];
+	int tlen = 0, vlen = 0;
+	uint64_t ms = 0, bits;
+	uint8_t *data;
+
+	if (!nblocks || !h)
+		return;
+	bits = dbltobits(value);
+	b = (h->tail >= 0) ? blocks+h->tail : NULL;
+	if (b) {
+		ms = (t > b->t0) ? llround((t - b->t0)*1e3) : 0;
+		if (ms < b->tlast)
+			ms = b->tlast;
+		tlen = put_varint(tbuf, ms - b->tlast);
+		vlen = put_value(vbuf, bits ^ b->vlast);
+	}
+	if (!b || b->tlen + tlen + b->vlen + vlen > HBLOCK) {
+		b = history_grow(h, t);
+		ms = 0;
+		tlen = put_varint(tbuf, 0);
+		vlen = put_value(vbuf, bits);
+	}
+	data = arena + (b - blocks)*HBLOCK;
+	memcpy(data + b->tlen, tbuf, tlen);
+	b->tlen += tlen;
+	b->vlen += vlen;
+	memcpy(data + HBLOCK - b->vlen, vbuf, vlen);
+	b->tlast = ms;
+	b->vlast = bits;
+	++b->nsamples;
+}
+
+/* iterate samples */
+struct hiter {
+	int blk;
+	int idx; /* sample index in block */
+	int tpos, vpos;
+	uint64_t ms, bits;
+	/* decoded sample */
+	double t, v;
+};
+
+static void hiter_block(struct hiter *it, int blk)
+{
+	it->blk = blk;
+	it->idx = 0;
+	it->tpos = 0;
+	it->vpos = HBLOCK;
+	it->ms = 0;
+	it->bits = 0;
+}
+
+/* skip blocks that end before @t, keep their last sample */
+static void hiter_seek(struct hiter *it, double t)
+{
+	const struct hblock *b;
+
+	for (; it->blk >= 0; hiter_block(it, b->next)) {
+		b = blocks + it->blk;
+		if (b->next < 0 || blocks[b->next].t0 > t)
+			break;
+		it->t = b->t0 + b->tlast*1e-3;
+		it->v = bitstodbl(b->vlast);
+	}
+}
+
+static int hiter_next(struct hiter *it)
+{
+	const struct hblock *b;
+	const uint8_t *data;
+	uint64_t delta;
+
+	for (;;) {
+		if (it->blk < 0)
+			return 0;
+		b = blocks + it->blk;
+		if (it->idx < b->nsamples)
+			break;
+		hiter_block(it, b->next);
+	}
+	data = arena + it->blk*HBLOCK;
+	it->tpos += get_varint(data + it->tpos, &delta);
+	it->ms += delta;
+	it->vpos -= get_value(data, it->vpos, &delta);
+	it->bits ^= delta;
+	++it->idx;
+
+	it->t = b->t0 + it->ms*1e-3;
+	it->v = bitstodbl(it->bits);
+	return 1;
+}
+
+double history_value(const struct history *h, double t)
+{
+	struct hiter it = { .v = NAN, };
+	double value;
+
+	if (!h || h->head < 0)
+		return NAN;
+	hiter_block(&it, h->head);
+	hiter_seek(&it, t);
+	value = it.v;
+	while (hiter_next(&it) && it.t <= t)
+		value = it.v;
+	return value;
+}
+
+double history_integral(const struct history *h, double from, double to)
+{
+	struct hiter it = { .t = NAN, .v = NAN, };
+	double sum, t, v, t0, t1;
+
+	if (!h || h->head < 0)
+		return NAN;
+	hiter_block(&it, h->head);
+	hiter_seek(&it, from);
+	t = it.t;
+	v = it.v;
+	sum = 0;
+	for (;;) {
+		int more = hiter_next(&it);
+		double tnext = more ? it.t : to;
+
+		/* add the slice where v was valid */
+		t0 = (t > from) ? t : from;
+		t1 = (tnext < to) ? tnext : to;
+		if (!isnan(t) && !isnan(v) && t1 > t0)
+			sum += v * (t1 - t0);
+		if (!more || tnext >= to)
+			break;
+		t = it.t;
+		v = it.v;
+	}
+	return sum;
+}
@@ -0,0 +1,31 @@
+#ifndef _history_h_
+#define _history_h_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* compact history of (time, value) samples
+ * All histories share 1 arena of fixed-size blocks.
+ * When the arena is full, the oldest block is recycled.
+ */
+struct history;
+
+/* allocate the shared arena, @size in bytes */
+extern void history_init(long size);
+
+extern struct history *history_new(void);
+extern void history_free(struct history *);
+
+/* append a sample, @t must not decrease */
+extern void history_add(struct history *, double t, double value);
+
+/* value at time @t, NAN when @t is before the oldest sample */
+extern double history_value(const struct history *, double t);
+
+/* time-integral of the value between @from and @to */
+extern double history_integral(const struct history *, double from, double to);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This file is part of libet.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <math.h>
+#include <time.h>
+
+#include "libt.h"
+
+/* try to synchronise timeslices with walltime
+ * This lives apart from libt.c, so vlibt.c can use it too.
+ */
+double libt_timetointerval4(double walltime, double interval, double offset, double pad)
+{
+	double value;
+
+	/* TODO: can we skip this test? */
+	if (interval >= 3600*1.5) {
+		long gmtoff;
+		time_t lwalltime, newtime;
+		struct tm *tm;
+
+		lwalltime = walltime;
+		gmtoff = localtime(&lwalltime)->tm_gmtoff;
+		value = interval - fmod(walltime + gmtoff - offset, interval);
+		/* verify target time */
+		newtime = walltime + value;
+		tm = localtime(&newtime);
+		if (tm->tm_gmtoff != gmtoff)
+			/* timezone daylight saving difference, add the difference */
+			value = value + gmtoff - tm->tm_gmtoff;
+	} else {
+		/* simple case, not localtime stuff */
+		value = interval - fmod(walltime - offset, interval);
+	}
+
+	if (value < pad)
+		/* skip 1 */
+		value = value + pad + libt_timetointerval4(walltime + value + pad, interval, offset, pad);
+	return value;
+}
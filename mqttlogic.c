@@ -4,6 +4,7 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +15,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <syslog.h>
+#include <dlfcn.h>
 #include <sys/signalfd.h>
 #include <mosquitto.h>
 
@@ -21,6 +23,8 @@
 #include "lib/libe.h"
 #include "lib/libtimechange.h"
 #include "rpnlogic.h"
+#include "history.h"
+#include "aggr.h"
 #include "common.h"
 
 #define NAME "mqttlogic"
@@ -45,6 +49,10 @@ static const char help_msg[] =
 	" -b, --button=STR	Give MQTT topic suffix for button handler scripts (default '/button')\n"
 	" -B, --longbutton=STR	Give MQTT topic suffix for longbutton handler scripts (default '/longbutton')\n"
 	" -w, --write=STR	Give MQTT topic suffix for writing the topic on /logicw (default /set)\n"
+	" -H, --history=SIZE	Memory for topic history, used by ago & integral (default 256k)\n"
+	"			SIZE takes a k or M suffix, 0 disables the history\n"
+	" -N, --native=FILE	Load logic compiled by rpn2c from shared object FILE\n"
+	" -P, --plugin=FILE	Load operators from shared object FILE, may repeat\n"
 	"\n"
 	"Paramteres\n"
 	" PATTERN	A pattern to subscribe for\n"
@@ -64,6 +72,9 @@ static struct option long_opts[] = {
 	{ "write", required_argument, NULL, 'w', },
 	{ "button", required_argument, NULL, 'b', },
 	{ "longbutton", required_argument, NULL, 'B', },
+	{ "history", required_argument, NULL, 'H', },
+	{ "native", required_argument, NULL, 'N', },
+	{ "plugin", required_argument, NULL, 'P', },
 
 	{ },
 };
@@ -71,7 +82,7 @@ static struct option long_opts[] = {
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?nm:s:S:c:w:b:B:";
+static const char optstring[] = "Vv?nm:s:S:c:w:b:B:H:N:P:";
 
 /* logging */
 static int loglevel = LOG_WARNING;
@@ -93,6 +104,10 @@ static const char *mqtt_flags_suffix = "/logicflags";
 static int mqtt_keepalive = 10;
 static int mqtt_qos = 1;
 static double long_btn_delay = 1.0;
+static long history_size = 256*1024;
+static const char *native_file;
+static const char **plugin_files;
+static int nplugin_files;
 
 /* state */
 static struct mosquitto *mosq;
@@ -111,6 +126,7 @@ struct item {
 
 	struct rpn *logic;
 	int logicflags;
+	int allflags; /* of logic, onchange & buttons */
 	int rpnflags;
 		#define RPNFL_VERBOSE	(1 << 0)
 		#define RPNFL_SILENT	(1 << 1)
@@ -132,20 +148,47 @@ static struct item *items;
 static struct stack rpnstack;
 
 /* topic cache */
+#define TOPIC_INLINE	24
 struct topic {
 	char *topic;
-	char *value;
+	/* the value lives in inl[] when short enough,
+	 * in buf[] otherwise. buf is kept for reuse.
+	 */
+	char *buf;
+	int len; /* strlen of value */
+	int size; /* allocated size of buf */
+	char inl[TOPIC_INLINE];
+	/* value parsed once on arrival */
+	double num;
+	int numeric; /* value was entirely a number */
+	/* history, when used by logic */
+	struct history *hist;
 	int ref;
 	int isnew;
+	int valid; /* a value has been stored */
 };
 static struct topic *topics;
 static int ntopics; /* used topics */
 static int stopics;
 
+/* wildcard aggregates */
+static struct aggr **aggrs;
+static int naggrs;
+
+/* topics with history */
+struct topichist {
+	char *topic;
+	int ref;
+	struct history *hist;
+};
+static struct topichist **hists;
+static int nhists;
+
 #define myfree(x) ({ if (x) { free(x); (x) = NULL; }})
 
 static struct item *curritem;
 static struct topic *currtopic;
+static struct topic *lastrpntopic;
 
 static int mqtt_ready;
 
@@ -196,18 +239,74 @@ static void mqttloghook(int level, const char *payload)
 
 /* mqtt cache */
 static int rpn_has_ref(struct rpn *rpn, const char *topic);
+static int rpn_count_ref(struct rpn *rpn, const char *topic);
+static void aggr_update(struct topic *topic, int add);
 static void on_btn_long(void *dat);
 
+static int topic_matches(const char *pattern, const char *topic)
+{
+	bool result;
+
+	if (mosquitto_topic_matches_sub(pattern, topic, &result))
+		return 0;
+	return result;
+}
+
 static int topiccmp(const void *a, const void *b)
 {
 	return strcmp(((const struct topic *)a)->topic ?: "", ((const struct topic *)b)->topic ?: "");
 }
 
+static inline const char *topic_value(const struct topic *topic)
+{
+	return (topic->len < sizeof(topic->inl)) ? topic->inl : topic->buf;
+}
+
+/* store a new value and update the aggregates,
+ * return 0 when the value did not change
+ * The first value of a new topic is a change, also when empty
+ */
+static int topic_set_value(struct topic *topic, const char *payload, int payloadlen)
+{
+	char *dst;
+	int len;
+
+	len = payload ? strnlen(payload, payloadlen) : 0;
+	if (topic->valid && len == topic->len && !memcmp(topic_value(topic), payload ?: "", len))
+		return 0;
+	aggr_update(topic, -1);
+	if (len < sizeof(topic->inl)) {
+		dst = topic->inl;
+	} else {
+		if (len >= topic->size) {
+			/* grow in steps, to avoid realloc on every small change */
+			topic->size = (len + 1 + 63) & ~63;
+			topic->buf = realloc(topic->buf, topic->size);
+			if (!topic->buf)
+				mylog(LOG_ERR, "realloc %i: %s", topic->size, ESTR(errno));
+		}
+		dst = topic->buf;
+	}
+	memcpy(dst, payload ?: "", len);
+	dst[len] = 0;
+	topic->len = len;
+	topic->valid = 1;
+
+	char *endp;
+
+	topic->num = mystrtod(dst, &endp);
+	/* "nan" or "inf" would poison the aggregates */
+	topic->numeric = endp > dst && !*endp && isfinite(topic->num);
+	aggr_update(topic, +1);
+	return 1;
+}
+
 struct topic *get_topic(const char *name, int create)
 {
 	struct topic *topic;
 	struct topic ref = { .topic = (char *)name, };
 	struct item *it;
+	int j;
 
 	topic = bsearch(&ref, topics, ntopics, sizeof(*topics), topiccmp);
 	if (topic)
@@ -219,25 +318,175 @@ struct topic *get_topic(const char *name, int create)
 		stopics += 128;
 		topics = realloc(topics, sizeof(*topics)*stopics);
 	}
-	topics[ntopics++] = (struct topic){ .topic = strdup(name), };
+	topics[ntopics++] = (struct topic){ .topic = strdup(name), .num = NAN, };
 	qsort(topics, ntopics, sizeof(*topics), topiccmp);
 	topic = get_topic(name, 0);
 
 	/* set already referenced topics */
 	for (it = items; it; it = it->next) {
-		if (rpn_has_ref(it->logic, name))
-			topic->ref += 1;
+		/* as rpn_add_ref counts them */
+		topic->ref += rpn_count_ref(it->logic, name) + rpn_count_ref(it->onchange, name) +
+			rpn_count_ref(it->btns, name) + rpn_count_ref(it->btnl, name);
+	}
+	for (j = 0; j < nhists; ++j) {
+		if (!strcmp(hists[j]->topic, name))
+			topic->hist = hists[j]->hist;
 	}
 	return topic;
 }
 
-static struct topic *lastrpntopic;
+/* wildcard aggregates */
+static void aggr_add_topic(struct aggr *aggr, const struct topic *topic, int add);
+
+/* recompute @aggr from its members, without @skip */
+static void aggr_rebuild(struct aggr *aggr, const struct topic *skip)
+{
+	int j;
+
+	aggr_reset(aggr);
+	for (j = 0; j < ntopics; ++j) {
+		if (topics+j != skip && topic_matches(aggr->pattern, topics[j].topic))
+			aggr_add_topic(aggr, topics+j, +1);
+	}
+}
+
+/* add (or remove when add < 0) the value of topic to the aggregate */
+static void aggr_add_topic(struct aggr *aggr, const struct topic *topic, int add)
+{
+	if (!topic->len)
+		/* cleared, or no value yet */
+		return;
+	if (aggr_add_value(aggr, topic->numeric, topic->num, add) < 0) {
+		mylog(LOG_WARNING, "%s: %s not in aggregate %s, recompute",
+				topic->topic, mydtostr(topic->num), aggr->pattern);
+		aggr_rebuild(aggr, topic);
+	}
+}
+
+static void aggr_update(struct topic *topic, int add)
+{
+	int j;
+
+	for (j = 0; j < naggrs; ++j) {
+		if (topic_matches(aggrs[j]->pattern, topic->topic))
+			aggr_add_topic(aggrs[j], topic, add);
+	}
+}
+
+static struct aggr *get_aggr(const char *pattern, int create)
+{
+	struct aggr *aggr;
+	int j;
+
+	for (j = 0; j < naggrs; ++j) {
+		if (!strcmp(aggrs[j]->pattern, pattern))
+			return aggrs[j];
+	}
+	if (!create)
+		return NULL;
+	aggr = aggr_new(pattern);
+	/* collect current members */
+	aggr_rebuild(aggr, NULL);
+	aggrs = realloc(aggrs, sizeof(*aggrs)*(naggrs+1));
+	aggrs[naggrs++] = aggr;
+	return aggr;
+}
+
+static void aggr_add_ref(const char *pattern, int add)
+{
+	struct aggr *aggr;
+	int j;
+
+	aggr = get_aggr(pattern, add > 0);
+	if (!aggr)
+		return;
+	aggr->ref += add;
+	if (aggr->ref > 0)
+		return;
+	/* remove */
+	for (j = 0; j < naggrs; ++j) {
+		if (aggrs[j] == aggr) {
+			aggrs[j] = aggrs[--naggrs];
+			break;
+		}
+	}
+	aggr_free(aggr);
+}
+
+/* topic history */
+static void hist_add_ref(const char *name, int add)
+{
+	struct topichist *th = NULL;
+	struct topic *topic;
+	int j;
+
+	for (j = 0; j < nhists; ++j) {
+		if (!strcmp(hists[j]->topic, name)) {
+			th = hists[j];
+			break;
+		}
+	}
+	topic = get_topic(name, 0);
+	if (!th) {
+		if (add <= 0)
+			return;
+		th = malloc(sizeof(*th));
+		if (!th)
+			mylog(LOG_ERR, "malloc topichist: %s", ESTR(errno));
+		memset(th, 0, sizeof(*th));
+		th->topic = strdup(name);
+		th->hist = history_new();
+		if (topic) {
+			topic->hist = th->hist;
+			if (topic->numeric)
+				/* start with the current value */
+				history_add(th->hist, libt_now(), topic->num);
+		}
+		hists = realloc(hists, sizeof(*hists)*(nhists+1));
+		hists[nhists++] = th;
+		j = nhists-1;
+	}
+	th->ref += add;
+	if (th->ref > 0)
+		return;
+	/* remove */
+	if (topic)
+		topic->hist = NULL;
+	hists[j] = hists[--nhists];
+	history_free(th->hist);
+	free(th->topic);
+	free(th);
+}
+
+double rpn_history_value(const char *name, double t, struct rpn *rpn)
+{
+	struct topic *topic = get_topic(name, 0);
+
+	return (topic && topic->hist) ? history_value(topic->hist, t) : NAN;
+}
+
+double rpn_history_integral(const char *name, double from, double to, struct rpn *rpn)
+{
+	struct topic *topic = get_topic(name, 0);
+
+	return (topic && topic->hist) ? history_integral(topic->hist, from, to) : NAN;
+}
+
+const struct rpn_aggr *rpn_lookup_aggr(const char *pattern, struct rpn *rpn)
+{
+	struct aggr *aggr;
+
+	lastrpntopic = NULL;
+	aggr = get_aggr(pattern, 0);
+	return aggr ? &aggr->v : NULL;
+}
+
 int rpn_env_isnew(void)
 {
 	return lastrpntopic && lastrpntopic->isnew;
 }
 
-const char *rpn_lookup_env(const char *name, struct rpn *rpn)
+const char *rpn_lookup_env(const char *name, struct rpn *rpn, double *pvalue)
 {
 	struct topic *topic;
 
@@ -259,7 +508,8 @@ const char *rpn_lookup_env(const char *name, struct rpn *rpn)
 		free(curritem->missingtopic);
 		curritem->missingtopic = NULL;
 	}
-	return topic->value;
+	*pvalue = topic->num;
+	return topic_value(topic);
 }
 
 int rpn_write_env(const char *value, const char *name, struct rpn *rpn)
@@ -296,10 +546,22 @@ static void rpn_resolve_relative(struct rpn *rpn, const char *topic)
 static void rpn_add_ref(struct rpn *rpn, int add)
 {
 	struct topic *topic;
+	int j;
 
 	for (; rpn; rpn = rpn->next) {
 		if (!rpn->topic)
 			continue;
+		if (rpn->flags & RPNFN_HISTORY)
+			hist_add_ref(rpn->topic, add);
+		if (strpbrk(rpn->topic, "+#")) {
+			/* wildcard, refer to all members */
+			aggr_add_ref(rpn->topic, add);
+			for (j = 0; j < ntopics; ++j) {
+				if (topic_matches(rpn->topic, topics[j].topic))
+					topics[j].ref += add;
+			}
+			continue;
+		}
 		topic = get_topic(rpn->topic, 0);
 		if (!topic)
 			continue;
@@ -311,12 +573,29 @@ static void rpn_add_ref(struct rpn *rpn, int add)
 static int rpn_has_ref(struct rpn *rpn, const char *topic)
 {
 	for (; rpn; rpn = rpn->next) {
-		if (rpn->topic && !strcmp(topic, rpn->topic))
+		if (!rpn->topic)
+			continue;
+		if (!strcmp(topic, rpn->topic))
+			return 1;
+		if (strpbrk(rpn->topic, "+#") && topic_matches(rpn->topic, topic))
 			return 1;
 	}
 	return 0;
 }
 
+/* number of references to @topic */
+static int rpn_count_ref(struct rpn *rpn, const char *topic)
+{
+	int n = 0;
+
+	for (; rpn; rpn = rpn->next) {
+		if (rpn->topic && (!strcmp(topic, rpn->topic) ||
+				(strpbrk(rpn->topic, "+#") && topic_matches(rpn->topic, topic))))
+			++n;
+	}
+	return n;
+}
+
 static int rpn_referred(struct rpn *rpn, void *dat)
 {
 	for (; rpn; rpn = rpn->next) {
@@ -373,6 +652,13 @@ static struct item *get_item(const char *topic, const char *suffix, int create)
 	return it;
 }
 
+static void item_collect_flags(struct item *it)
+{
+	it->logicflags = rpn_collect_flags(it->logic);
+	it->allflags = it->logicflags | rpn_collect_flags(it->onchange) |
+		rpn_collect_flags(it->btns) | rpn_collect_flags(it->btnl);
+}
+
 static void drop_item(struct item *it, struct rpn **prpn)
 {
 	if (*prpn) {
@@ -381,8 +667,10 @@ static void drop_item(struct item *it, struct rpn **prpn)
 		*prpn = NULL;
 	}
 	libt_remove_timeout(on_btn_long, it);
-	if (it->logic || it->onchange || it->btns || it->btnl)
+	if (it->logic || it->onchange || it->btns || it->btnl) {
+		item_collect_flags(it);
 		return;
+	}
 	/* remove from list */
 	if (it->prev)
 		it->prev->next = it->next;
@@ -439,7 +727,7 @@ static void do_logic(struct item *it, struct topic *trigger)
 		return;
 	else if (trigger && !strcmp(trigger->topic, it->topic)) {
 		/* This new calculation is triggered by the topic itself: beware loops */
-		if (!strcmp(result, trigger->value ?: ""))
+		if (!strcmp(result, topic_value(trigger)))
 			/* our result changed to the current value: ok
 			 * no need to republish
 			 */
@@ -498,6 +786,35 @@ static void on_btn_long(void *dat)
 	it->btnvalue = 0;
 }
 
+/* rpn profiler control: on, off or dump */
+static void rpnprofile_ctl(const char *cmd)
+{
+	static const char reporttopic[] = "tools/rpnprofile/report";
+	char *report = NULL;
+	size_t size = 0;
+	FILE *fp;
+	int ret;
+
+	if (!strcmp(cmd, "on") || !strcmp(cmd, "1")) {
+		rpn_profile_reset();
+		rpn_profile_enable(1);
+	} else if (!strcmp(cmd, "off") || !strcmp(cmd, "0")) {
+		rpn_profile_enable(0);
+	} else if (!strcmp(cmd, "dump")) {
+		fp = open_memstream(&report, &size);
+		if (!fp)
+			mylog(LOG_ERR, "open_memstream: %s", ESTR(errno));
+		rpn_profile_dump(fp);
+		fclose(fp);
+		ret = mosquitto_publish(mosq, NULL, reporttopic, size, report, mqtt_qos, 0);
+		if (ret)
+			mylog(LOG_WARNING, "mosquitto_publish %s: %s", reporttopic, mosquitto_strerror(ret));
+		free(report);
+	} else if (*cmd) {
+		mylog(LOG_WARNING, "tools/rpnprofile: unknown '%s'", cmd);
+	}
+}
+
 static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitto_message *msg)
 {
 	struct item *it;
@@ -514,6 +831,8 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 
 	if (!strcmp(msg->topic, "tools/loglevel")) {
 		mysetloglevelstr(msg->payload);
+	} else if (!strcmp(msg->topic, "tools/rpnprofile")) {
+		rpnprofile_ctl(msg->payload ?: "");
 	} else if (test_suffix(msg->topic, mqtt_suffix)) {
 		/* this is a logic set msg */
 		it = get_item(msg->topic, mqtt_suffix, msg->payloadlen);
@@ -537,7 +856,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 		rpn_free_chain(it->logic);
 		/* prepare new info */
 		it->logic = rpn_parse(msg->payload, it);
-		it->logicflags = rpn_collect_flags(it->logic);
+		item_collect_flags(it);
 		rpn_resolve_relative(it->logic, it->topic);
 		rpn_ref(it->logic);
 		myfree(it->logic_payload);
@@ -567,7 +886,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 		rpn_free_chain(it->logic);
 		/* prepare new info */
 		it->logic = rpn_parse(msg->payload, it);
-		it->logicflags = rpn_collect_flags(it->logic);
+		item_collect_flags(it);
 		rpn_resolve_relative(it->logic, it->topic);
 		rpn_ref(it->logic);
 		myfree(it->logic_payload);
@@ -594,6 +913,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 		rpn_free_chain(it->onchange);
 		/* prepare new info */
 		it->onchange = rpn_parse(msg->payload, it);
+		item_collect_flags(it);
 		rpn_resolve_relative(it->onchange, it->topic);
 		rpn_ref(it->onchange);
 		myfree(it->onchange_payload);
@@ -618,6 +938,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 		rpn_free_chain(it->btns);
 		/* prepare new info */
 		it->btns = rpn_parse(msg->payload, it);
+		item_collect_flags(it);
 		rpn_resolve_relative(it->btns, it->topic);
 		rpn_ref(it->btns);
 		myfree(it->btns_payload);
@@ -642,6 +963,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 		rpn_free_chain(it->btnl);
 		/* prepare new info */
 		it->btnl = rpn_parse(msg->payload, it);
+		item_collect_flags(it);
 		rpn_resolve_relative(it->btnl, it->topic);
 		rpn_ref(it->btnl);
 		myfree(it->btnl_payload);
@@ -661,11 +983,29 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 	/* find topic */
 	topic = get_topic(msg->topic, msg->payloadlen);
 	if (topic) {
-		free(topic->value);
-		topic->value = strndup(msg->payload ?: "", msg->payloadlen);
+		int changed;
+
+		changed = topic_set_value(topic, msg->payload, msg->payloadlen);
+		if (changed && topic->hist)
+			history_add(topic->hist, libt_now(), topic->num);
+
+		if (changed && topic->ref) {
+			/* only referenced topics can be in cached segments */
+			for (it = items; it; it = it->next) {
+				rpn_env_changed(it->logic, msg->topic);
+				rpn_env_changed(it->onchange, msg->topic);
+				rpn_env_changed(it->btns, msg->topic);
+				rpn_env_changed(it->btnl, msg->topic);
+			}
+		}
 		currtopic = topic;
 		if (topic->ref) {
 			for (it = items; it; it = it->next) {
+				if (!changed && !(it->allflags & RPNFN_EVENT))
+					/* republished identical value,
+					 * only event-style logic cares
+					 */
+					continue;
 				if (rpn_has_ref(it->logic, msg->topic))
 					do_logic(it, topic);
 			}
@@ -797,9 +1137,51 @@ static void signalrecvd(int fd, void *dat)
 	}
 }
 
+/* operators from a plugin */
+static void load_plugin(const char *file)
+{
+	void *dl;
+	const int *version;
+	const struct lookup *lookups;
+
+	dl = dlopen(file, RTLD_NOW);
+	if (!dl)
+		mylog(LOG_ERR, "dlopen %s: %s", file, dlerror());
+	version = dlsym(dl, "rpn_plugin_version");
+	lookups = dlsym(dl, "rpn_plugin_lookups");
+	if (!version || !lookups) {
+		dlclose(dl);
+		mylog(LOG_ERR, "%s: no rpn plugin", file);
+	}
+	if (rpn_add_lookups(lookups, *version) < 0) {
+		dlclose(dl);
+		mylog(LOG_ERR, "%s: plugin refused", file);
+	}
+}
+
+/* natively compiled logic */
+static void load_natives(const char *file)
+{
+	void *dl;
+	const int *version;
+	const struct rpn_native *natives;
+
+	dl = dlopen(file, RTLD_NOW);
+	if (!dl)
+		mylog(LOG_ERR, "dlopen %s: %s", file, dlerror());
+	version = dlsym(dl, "rpn_native_version");
+	natives = dlsym(dl, "rpn_natives");
+	if (!version || !natives)
+		mylog(LOG_ERR, "%s: no rpn natives", file);
+	if (*version != RPN_NATIVE_VERSION)
+		mylog(LOG_ERR, "%s: version %i, expected %i", file, *version, RPN_NATIVE_VERSION);
+	rpn_add_natives(natives);
+}
+
 int main(int argc, char *argv[])
 {
-	int opt, ret;
+	int opt, ret, j;
+	long mul;
 	char *str;
 	char mqtt_name[32];
 
@@ -843,6 +1225,30 @@ int main(int argc, char *argv[])
 	case 'w':
 		mqtt_write_suffix = optarg;
 		break;
+	case 'H':
+		history_size = strtol(optarg, &str, 0);
+		mul = 1;
+		if (*str == 'k')
+			mul = 1024;
+		else if (*str == 'M')
+			mul = 1024*1024;
+		if (mul > 1)
+			++str;
+		if (str == optarg || *str || history_size < 0 || history_size > LONG_MAX / mul) {
+			fprintf(stderr, "bad history size '%s'\n", optarg);
+			exit(1);
+		}
+		history_size *= mul;
+		break;
+	case 'N':
+		native_file = optarg;
+		break;
+	case 'P':
+		plugin_files = realloc(plugin_files, sizeof(*plugin_files)*(nplugin_files+1));
+		if (!plugin_files)
+			mylog(LOG_ERR, "realloc plugins: %s", ESTR(errno));
+		plugin_files[nplugin_files++] = optarg;
+		break;
 
 	default:
 		fprintf(stderr, "unknown option '%c'\n", opt);
@@ -855,6 +1261,11 @@ int main(int argc, char *argv[])
 	myopenlog(NAME, 0, LOG_LOCAL2);
 	myloglevel(loglevel);
 	setlocale(LC_TIME, "");
+	history_init(history_size);
+	for (j = 0; j < nplugin_files; ++j)
+		load_plugin(plugin_files[j]);
+	if (native_file)
+		load_natives(native_file);
 
 	/* MQTT start */
 	mosquitto_lib_init();
@@ -0,0 +1,240 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <syslog.h>
+
+#include "lib/libt.h"
+#include "rpnlogic.h"
+#include "common.h"
+
+#define NAME "rpn2c"
+#ifndef VERSION
+#define VERSION "<undefined version>"
+#endif
+
+/* program options */
+static const char help_msg[] =
+	NAME ": translate rpn logic into C, for mqttlogic -N\n"
+	"usage:	" NAME " [OPTIONS ...] [FILE]\n"
+	"\n"
+	"Options\n"
+	" -V, --version		Show version\n"
+	" -v, --verbose		Be more verbose\n"
+	" -o, --output=FILE	Write C to FILE (default stdout)\n"
+	"\n"
+	"Paramteres\n"
+	" FILE		Logic input (default stdin), 1 logic per line\n"
+	"\n"
+	"Logic that can't be translated is skipped, mqttlogic\n"
+	"interprets it as before. Build the output with i.e.\n"
+	"	gcc -O2 -shared -fPIC -I<mqttautomation> -o logic.so logic.c -lm\n"
+	;
+
+#ifdef _GNU_SOURCE
+static struct option long_opts[] = {
+	{ "help", no_argument, NULL, '?', },
+	{ "version", no_argument, NULL, 'V', },
+	{ "verbose", no_argument, NULL, 'v', },
+	{ "output", required_argument, NULL, 'o', },
+
+	{ },
+};
+#else
+#define getopt_long(argc, argv, optstring, longopts, longindex) \
+	getopt((argc), (argv), (optstring))
+#endif
+static const char optstring[] = "Vv?o:";
+
+static int loglevel = LOG_WARNING;
+
+/* imports for rpnlogic, never called */
+const char *rpn_lookup_env(const char *str, struct rpn *rpn, double *pvalue)
+{
+	return NULL;
+}
+
+int rpn_write_env(const char *value, const char *str, struct rpn *rpn)
+{
+	return 0;
+}
+
+const struct rpn_aggr *rpn_lookup_aggr(const char *pattern, struct rpn *rpn)
+{
+	return NULL;
+}
+
+double rpn_history_value(const char *topic, double t, struct rpn *rpn)
+{
+	return NAN;
+}
+
+double rpn_history_integral(const char *topic, double from, double to, struct rpn *rpn)
+{
+	return NAN;
+}
+
+int rpn_env_isnew(void)
+{
+	return 0;
+}
+
+void rpn_run_again(void *dat)
+{
+}
+
+/* translated logic */
+static char **sigs;
+static int nsigs;
+
+static int sig_exists(const char *sig)
+{
+	int j;
+
+	for (j = 0; j < nsigs; ++j) {
+		if (!strcmp(sigs[j], sig))
+			return 1;
+	}
+	return 0;
+}
+
+static void emit_sig(FILE *fp, const char *sig)
+{
+	fputc('"', fp);
+	for (; *sig; ++sig) {
+		if (*sig == '"' || *sig == '\\')
+			fprintf(fp, "\\%c", *sig);
+		else if (*sig >= ' ' && *sig < 0x7f)
+			fputc(*sig, fp);
+		else
+			fprintf(fp, "\\%03o", *sig & 0xff);
+	}
+	fputc('"', fp);
+}
+
+static void translate(FILE *fp, const char *line)
+{
+	struct rpn *logic;
+	char *sig, *code = NULL;
+	size_t size = 0;
+	FILE *mem;
+	char name[32];
+	int ret;
+
+	logic = rpn_parse(line, NULL);
+	if (!logic) {
+		mylog(LOG_WARNING, "'%s': parse failed", line);
+		return;
+	}
+	sig = rpn_native_signature(logic);
+	if (sig_exists(sig)) {
+		free(sig);
+		goto done;
+	}
+	sprintf(name, "rpn_native_%i", nsigs);
+	mem = open_memstream(&code, &size);
+	if (!mem)
+		mylog(LOG_ERR, "open_memstream: %s", ESTR(errno));
+	ret = rpn_emit_c(mem, logic, name);
+	fclose(mem);
+	if (ret < 0) {
+		mylog(LOG_NOTICE, "'%s': not translated", line);
+		free(sig);
+		goto done;
+	}
+	/* logic as comment, if it does not end it */
+	if (!strstr(line, "*/"))
+		fprintf(fp, "/* %s */\n", line);
+	fprintf(fp, "%s\n", code);
+	sigs = realloc(sigs, sizeof(*sigs)*(nsigs+1));
+	if (!sigs)
+		mylog(LOG_ERR, "realloc signatures: %s", ESTR(errno));
+	sigs[nsigs++] = sig;
+done:
+	free(code);
+	rpn_free_chain(logic);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, j;
+	FILE *fp, *out = stdout;
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t len;
+
+	/* argument parsing */
+	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
+	switch (opt) {
+	case 'V':
+		fprintf(stderr, "%s %s\nCompiled on %s %s\n",
+				NAME, VERSION, __DATE__, __TIME__);
+		exit(0);
+	case 'v':
+		++loglevel;
+		break;
+	case 'o':
+		out = fopen(optarg, "w");
+		if (!out)
+			mylog(LOG_ERR, "fopen %s: %s", optarg, ESTR(errno));
+		break;
+
+	default:
+		fprintf(stderr, "unknown option '%c'\n", opt);
+	case '?':
+		fputs(help_msg, stderr);
+		exit(1);
+		break;
+	}
+
+	myopenlog(NAME, 0, LOG_LOCAL2);
+	myloglevel(loglevel);
+
+	if (optind < argc) {
+		fp = fopen(argv[optind], "r");
+		if (!fp)
+			mylog(LOG_ERR, "fopen %s: %s", argv[optind], ESTR(errno));
+	} else
+		fp = stdin;
+
+	fprintf(out, "/* generated by " NAME " " VERSION " */\n");
+	fprintf(out, "#include <math.h>\n");
+	fprintf(out, "#include <stddef.h>\n");
+	fprintf(out, "#include <strings.h>\n");
+	fprintf(out, "#include \"rpnlogic.h\"\n\n");
+	fprintf(out, "static inline int rpn_toint(double val)\n{\n");
+	fprintf(out, "\treturn isnan(val) ? 0 : (int)val;\n}\n\n");
+
+	for (;;) {
+		len = getline(&line, &linesize, fp);
+		if (len < 0)
+			break;
+		if (len && line[len-1] == '\n')
+			line[--len] = 0;
+		if (len && line[len-1] == '\r')
+			line[--len] = 0;
+		if (!len || *line == '#')
+			continue;
+		translate(out, line);
+	}
+
+	fprintf(out, "const int rpn_native_version = RPN_NATIVE_VERSION;\n\n");
+	fprintf(out, "const struct rpn_native rpn_natives[] = {\n");
+	for (j = 0; j < nsigs; ++j) {
+		fputc('\t', out);
+		fputs("{ ", out);
+		emit_sig(out, sigs[j]);
+		fprintf(out, ", rpn_native_%i, },\n", j);
+		free(sigs[j]);
+	}
+	fprintf(out, "\t{ },\n};\n");
+	if (out != stdout)
+		fclose(out);
+	else
+		fflush(out);
+	return 0;
+}
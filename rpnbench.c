@@ -0,0 +1,353 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <locale.h>
+#include <syslog.h>
+
+#include "vlibt.h"
+#include "rpnlogic.h"
+#include "common.h"
+
+#define NAME "rpnbench"
+#ifndef VERSION
+#define VERSION "<undefined version>"
+#endif
+
+/* program options */
+static const char help_msg[] =
+	NAME ": benchmark rpn logic\n"
+	"usage:	" NAME " [OPTIONS ...] [BENCH ...]\n"
+	"\n"
+	"Options\n"
+	" -V, --version		Show version\n"
+	" -v, --verbose		Be more verbose\n"
+	" -n, --iterations=NUM	Iterations per benchmark (default 200000)\n"
+	" -l, --list		List the benchmarks\n"
+	"\n"
+	"Paramteres\n"
+	" BENCH		Run only these benchmarks (default all)\n"
+	"\n"
+	"Inputs change on each iteration, and the virtual clock\n"
+	"advances 1s, so timers fire as they would live.\n"
+	;
+
+#ifdef _GNU_SOURCE
+static struct option long_opts[] = {
+	{ "help", no_argument, NULL, '?', },
+	{ "version", no_argument, NULL, 'V', },
+	{ "verbose", no_argument, NULL, 'v', },
+	{ "iterations", required_argument, NULL, 'n', },
+	{ "list", no_argument, NULL, 'l', },
+
+	{ },
+};
+#else
+#define getopt_long(argc, argv, optstring, longopts, longindex) \
+	getopt((argc), (argv), (optstring))
+#endif
+static const char optstring[] = "Vv?n:l";
+
+static int loglevel = LOG_WARNING;
+static long niterations = 200000;
+
+/* count allocations, by interposing the allocator */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static unsigned long nallocs;
+
+void *malloc(size_t size)
+{
+	++nallocs;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	++nallocs;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	++nallocs;
+	return __libc_realloc(ptr, size);
+}
+
+/* benchmarks */
+static const struct bench {
+	const char *name;
+	const char *logic;
+} benches[] = {
+	/* operator classes */
+	{ "arith", "${a} 2 * ${b} + ${c} - 3 / 7 %", },
+	{ "compare", "${a} ${b} < ${c} 10 > && ${a} ${b} == ||", },
+	{ "json", "${j} \"room/temp\" json", },
+	{ "printf", "${a} \"%.2f\" printf", },
+	{ "jsonobj", "${a} ${b} ${c} ${s} jsonobj,a,b,c,state", },
+	{ "strftime", "${t} \"%H:%M\" strftime", },
+	{ "delaytostr", "${a} delaytostr", },
+	{ "ondelay", "${s} 5 ondelay", },
+	{ "debounce", "${s} 2 debounce", },
+	{ "ravg", "${a} 60 ravg", },
+	{ "rmax", "${a} 600 rmax", },
+	{ "rmedian", "${a} 600 rmedian", },
+	{ "interp", "${a} interp,-10,0,0,5,10,15,20,40,30,70,40,90,50,100", },
+	{ "sun", "52 4 sun", },
+	{ "sun3", "${t} 52 4 sun3", },
+	{ "sunabove", "52 4 0 sunabove", },
+	/* programs */
+	{ "nightled", "${t} 52 4 sun3 0 <", },
+	{ "thermostat", "${a} ${b} 0.5 - ${b} 0.5 + hyst2 ${s} &&", },
+	{ "hall", "${s} 30 offdelay ${a} 50 > &&", },
+	{ "alarm", "${j} \"alarm/armed\" json if ${s} 3 ondelay else 0 fi", },
+	{ "display", "${a} ${c} max \"%.1f\" printf", },
+	{ },
+};
+
+/* topics, with NVALUES values each */
+#define NVALUES	64
+static struct topic {
+	const char *name;
+	const char *values[NVALUES];
+	double nums[NVALUES];
+} topics[] = {
+	{ "a", },
+	{ "b", },
+	{ "c", },
+	{ "j", },
+	{ "s", },
+	{ "t", },
+	{ },
+};
+static int cur; /* current value index */
+
+static void init_topics(void)
+{
+	struct topic *topic;
+	char *str;
+	int j;
+
+	for (topic = topics; topic->name; ++topic) {
+		for (j = 0; j < NVALUES; ++j) {
+			switch (*topic->name) {
+			case 'a':
+			case 'b':
+			case 'c':
+				asprintf(&str, "%.2f", 20 + 30*sin(j*(*topic->name - 'a' + 1)*0.1));
+				break;
+			case 'j':
+				asprintf(&str, "{\"room\":{\"name\":\"hall\",\"temp\":%.1f},\"alarm\":{\"armed\":%i}}",
+						19 + (j % 7)*0.5, (j/5) & 1);
+				break;
+			case 's':
+				asprintf(&str, "%i", (j/7) & 1);
+				break;
+			case 't':
+				asprintf(&str, "%i", 1700000000 + j*1800);
+				break;
+			}
+			topic->values[j] = str;
+			topic->nums[j] = mystrtod(str, NULL);
+		}
+	}
+}
+
+/* imports for rpnlogic */
+const char *rpn_lookup_env(const char *str, struct rpn *rpn, double *pvalue)
+{
+	struct topic *topic;
+
+	for (topic = topics; topic->name; ++topic) {
+		if (!strcmp(topic->name, str)) {
+			*pvalue = topic->nums[cur];
+			return topic->values[cur];
+		}
+	}
+	return NULL;
+}
+
+int rpn_write_env(const char *value, const char *str, struct rpn *rpn)
+{
+	return 0;
+}
+
+const struct rpn_aggr *rpn_lookup_aggr(const char *pattern, struct rpn *rpn)
+{
+	return NULL;
+}
+
+double rpn_history_value(const char *topic, double t, struct rpn *rpn)
+{
+	return NAN;
+}
+
+double rpn_history_integral(const char *topic, double from, double to, struct rpn *rpn)
+{
+	return NAN;
+}
+
+int rpn_env_isnew(void)
+{
+	return 1;
+}
+
+static struct rpn *logic;
+static struct stack rpnstack;
+
+void rpn_run_again(void *dat)
+{
+	rpn_stack_reset(&rpnstack);
+	rpn_run(&rpnstack, logic);
+}
+
+/* timing */
+static double nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double ns, unsigned long allocs, long n)
+{
+	printf("%-12s %10.1f ns/op %8.2f allocs/op\n", name, ns/n, (double)allocs/n);
+}
+
+static void run_logic(long n)
+{
+	long j;
+
+	for (j = 0; j < n; ++j) {
+		cur = j % NVALUES;
+		vlibt_run_until(libt_now() + 1);
+		rpn_env_changed(logic, NULL);
+		rpn_stack_reset(&rpnstack);
+		rpn_run(&rpnstack, logic);
+	}
+}
+
+static void bench_run(const struct bench *bench)
+{
+	unsigned long allocs;
+	double t0;
+
+	logic = rpn_parse(bench->logic, NULL);
+	if (!logic)
+		mylog(LOG_ERR, "%s: parse '%s' failed", bench->name, bench->logic);
+	/* warm up: fill windows, caches & the string arena */
+	run_logic(niterations/10 ?: 1);
+
+	allocs = nallocs;
+	t0 = nsnow();
+	run_logic(niterations);
+	report(bench->name, nsnow() - t0, nallocs - allocs, niterations);
+
+	rpn_free_chain(logic);
+	logic = NULL;
+}
+
+static void bench_parse(void)
+{
+	const struct bench *bench = NULL;
+	unsigned long allocs;
+	double t0;
+	long j, n;
+
+	n = niterations/10 ?: 1;
+	allocs = nallocs;
+	t0 = nsnow();
+	for (j = 0; j < n; ++j) {
+		for (bench = benches; bench->name; ++bench)
+			rpn_free_chain(rpn_parse(bench->logic, NULL));
+	}
+	/* all but the terminator */
+	n *= sizeof(benches)/sizeof(benches[0]) - 1;
+	report("parse", nsnow() - t0, nallocs - allocs, n);
+}
+
+static const struct bench *find_bench(const char *name)
+{
+	const struct bench *bench;
+
+	for (bench = benches; bench->name; ++bench) {
+		if (!strcmp(bench->name, name))
+			return bench;
+	}
+	return NULL;
+}
+
+static int selected(const char *name, char **names)
+{
+	if (!*names)
+		return 1;
+	for (; *names; ++names) {
+		if (!strcmp(*names, name))
+			return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	const struct bench *bench;
+
+	/* argument parsing */
+	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
+	switch (opt) {
+	case 'V':
+		fprintf(stderr, "%s %s\nCompiled on %s %s\n",
+				NAME, VERSION, __DATE__, __TIME__);
+		exit(0);
+	case 'v':
+		++loglevel;
+		break;
+	case 'n':
+		niterations = strtol(optarg, NULL, 0);
+		if (niterations < 1)
+			niterations = 1;
+		break;
+	case 'l':
+		printf("parse\n");
+		for (bench = benches; bench->name; ++bench)
+			printf("%-12s %s\n", bench->name, bench->logic);
+		exit(0);
+
+	default:
+		fprintf(stderr, "unknown option '%c'\n", opt);
+	case '?':
+		fputs(help_msg, stderr);
+		exit(1);
+		break;
+	}
+
+	myopenlog(NAME, 0, LOG_LOCAL2);
+	myloglevel(loglevel);
+	/* fixed timezone & clock, for repeatable output */
+	setenv("TZ", "UTC", 1);
+	tzset();
+	setlocale(LC_TIME, "C");
+	vlibt_set_now(1700000000);
+	init_topics();
+	for (opt = optind; opt < argc; ++opt) {
+		if (strcmp(argv[opt], "parse") && !find_bench(argv[opt]))
+			mylog(LOG_ERR, "unknown benchmark '%s', see -l", argv[opt]);
+	}
+
+	if (selected("parse", argv+optind))
+		bench_parse();
+	for (bench = benches; bench->name; ++bench) {
+		if (selected(bench->name, argv+optind))
+			bench_run(bench);
+	}
+	rpn_stack_free(&rpnstack);
+	return 0;
+}
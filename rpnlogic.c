@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,9 +15,6 @@
 #include "astronomics.h"
 #include "common.h"
 
-static const struct rpn_el dummy = { .a = NULL, .d = NAN, };
-/* placeholder for quitting */
-#define QUIT	((struct rpn *)0xdeadbeef)
 /* manage */
 static struct rpn *rpn_create(void)
 {
@@ -30,20 +28,58 @@ static struct rpn *rpn_create(void)
 	return rpn;
 }
 
-static inline void *rpn_priv(struct rpn *rpn)
-{
-	return rpn+1;
-}
+/* allocate private date of rpn */
+static void rpn_alloc_priv(struct rpn *rpn, int privsize)
+{
+	rpn->priv = malloc(privsize);
+	if (!rpn->priv)
+		mylog(LOG_ERR, "malloc priv %i", privsize);
+	memset(rpn->priv, 0, privsize);
+}
+
+/* compiled program */
+enum {
+	OP_CALL,
+	OP_CONST,
+	OP_IF,
+	OP_JUMP,
+	OP_END,
+	/* variants that test for stack underflow */
+	OP_CALLCHK,
+	OP_IFCHK,
+	/* cached pure segment */
+	OP_SEG,
+	OP_SEGEND,
+};
 
-/* grow private date of rpn */
-static struct rpn *rpn_grow(struct rpn *rpn, int privsize)
-{
-	rpn = realloc(rpn, sizeof(*rpn) + privsize);
-	if (!rpn)
-		mylog(LOG_ERR, "realloc rpn %lu", (long)sizeof(*rpn)+privsize);
-	memset(rpn+1, 0, privsize);
-	return rpn;
-}
+struct rpn_prog {
+	/* private data of all rpn's, packed */
+	void *privs;
+	/* strings of folded constants */
+	char **strs;
+	int nstrs;
+	/* pure segments with cached result */
+	struct rpn_seg *segs;
+	int nsegs;
+	/* native variant, see rpn_add_natives */
+	int (*native)(struct stack *st, struct rpn *const *me, struct rpn_seg *segs);
+	struct rpn **me;
+	int maxdepth;
+	int ninsn;
+	struct rpn_insn {
+		int op;
+		int pops; /* for OP_CALLCHK */
+		int pushes, xpushes;
+		int jump; /* target insn for OP_IF, OP_JUMP & OP_SEG */
+		int seg; /* for OP_SEG & OP_SEGEND */
+		/* inline operands for OP_CONST */
+		double value;
+		const char *str;
+		void (*run)(struct stack *st, struct rpn *me);
+		struct rpn *me;
+		struct rpn_prof *prof;
+	} insn[];
+};
 
 static void free_lookup(struct rpn *rpn);
 static void rpn_free(struct rpn *rpn)
@@ -55,18 +91,44 @@ static void rpn_free(struct rpn *rpn)
 		free(rpn->constvalue);
 	if (rpn->timeout)
 		libt_remove_timeout(rpn->timeout, rpn);
+	if (rpn->priv && !rpn->privpacked)
+		free(rpn->priv);
 	free(rpn);
 }
 
+static void rpn_free_prog(struct rpn_prog *prog)
+{
+	int j;
+
+	if (!prog)
+		return;
+	if (prog->privs)
+		free(prog->privs);
+	for (j = 0; j < prog->nstrs; ++j)
+		free(prog->strs[j]);
+	if (prog->strs)
+		free(prog->strs);
+	for (j = 0; j < prog->nsegs; ++j)
+		free(prog->segs[j].deps);
+	if (prog->segs)
+		free(prog->segs);
+	if (prog->me)
+		free(prog->me);
+	free(prog);
+}
+
 void rpn_free_chain(struct rpn *rpn)
 {
 	struct rpn *tmp;
+	struct rpn_prog *prog = rpn ? rpn->prog : NULL;
 
 	while (rpn) {
 		tmp = rpn;
 		rpn = rpn->next;
 		rpn_free(tmp);
 	}
+	/* free after the rpn's, lookup->free may still use privs */
+	rpn_free_prog(prog);
 }
 
 static inline int rpn_toint(double val)
@@ -98,159 +160,512 @@ static inline int dblcmp(double a, double b, double diff)
 		return 1;
 }
 
-static void rpn_reserve(struct stack *st)
+/* make room for @n more elements */
+static void rpn_reserve(struct stack *st, int n)
 {
-	if (st->n >= st->s) {
-		st->s += 16;
+	if (st->n + n > st->s) {
+		st->s = (st->n + n + 15) & ~15;
 		st->v = realloc(st->v, st->s * sizeof(st->v[0]));
 		if (!st->v)
 			mylog(LOG_ERR, "realloc stack %u failed", st->s);
 	}
 }
 
-static void rpn_push_el(struct stack *st, const struct rpn_el *el)
+/* string arena
+ * Chunks are kept on reset, so pointers never move during
+ * an evaluation and steady state does not allocate.
+ */
+struct rpn_strchunk {
+	struct rpn_strchunk *next;
+	int size;
+	char data[];
+};
+
+static char *rpn_stralloc(struct stack *st, int len)
 {
-	rpn_reserve(st);
-	st->v[st->n++] = *el;
+	struct rpn_strchunk *chunk;
+	char *str;
+
+	while (!st->chunk || st->used + len > st->chunk->size) {
+		if (st->chunk && st->chunk->next) {
+			st->chunk = st->chunk->next;
+			st->used = 0;
+			continue;
+		}
+		chunk = malloc(sizeof(*chunk) + ((len > 4096) ? len : 4096));
+		if (!chunk)
+			mylog(LOG_ERR, "malloc string arena %i", len);
+		chunk->next = NULL;
+		chunk->size = (len > 4096) ? len : 4096;
+		if (st->chunk)
+			st->chunk->next = chunk;
+		else
+			st->chunks = chunk;
+		st->chunk = chunk;
+		st->used = 0;
+	}
+	str = st->chunk->data + st->used;
+	st->used += len;
+	return str;
 }
 
-static void rpn_push_str(struct stack *st, const char *str, double value)
+/* return the unused tail of the last allocation @str */
+static void rpn_strtrim(struct stack *st, const char *str)
 {
-	rpn_reserve(st);
-	st->v[st->n].a = str;
-	st->v[st->n++].d = value;
+	st->used = str - st->chunk->data + strlen(str) + 1;
 }
-static inline void rpn_push(struct stack *st, double value)
+
+static const char *rpn_strndup(struct stack *st, const char *str, int len)
 {
-	rpn_push_str(st, NULL, value);
+	char *dup = rpn_stralloc(st, len+1);
+
+	memcpy(dup, str, len);
+	dup[len] = 0;
+	return dup;
 }
-static struct rpn_el *rpn_pop1(struct stack *st)
+
+/* mystrtod on a token that is not null terminated */
+static double rpn_strntod(const char *str, int len, int *pok)
 {
-	if (st->n < 1) {
-		st->errnum = ECANCELED;
-		st->n = 0;
-		return (struct rpn_el *)&dummy;
-	} else {
-		st->n -= 1;
-		return st->v+st->n;
+	char buf[64], *endp;
+	double value;
+
+	if (len >= sizeof(buf)) {
+		/* no number is that long */
+		if (pok)
+			*pok = 0;
+		return NAN;
 	}
+	memcpy(buf, str, len);
+	buf[len] = 0;
+	value = mystrtod(buf, &endp);
+	if (pok)
+		*pok = endp > buf && !*endp;
+	return value;
 }
-static void rpn_pop(struct stack *st, int n)
+
+/* extract JSON */
+#include "jsmn/jsmn.h"
+
+/* member path, compiled into segments */
+struct jsonpath {
+	char *src; /* member string it was compiled from */
+	char *buf; /* segments, 0-terminated */
+	int nseg;
+	const char **seg;
+};
+
+/* tokenized document, reused within 1 evaluation */
+struct rpn_jsoncache {
+	const char *json;
+	int len;
+	int ntok;
+	int tokcnt;
+	jsmntok_t *tok;
+};
+
+static void free_jsonpath(struct rpn *me)
 {
-	if (st->n < n) {
-		st->errnum = ECANCELED;
-		st->n = 0;
-	} else
-		st->n -= n;
+	struct jsonpath *path = rpn_priv(me);
+
+	if (path->src)
+		free(path->src);
+	if (path->buf)
+		free(path->buf);
+	if (path->seg)
+		free(path->seg);
+	memset(path, 0, sizeof(*path));
 }
-static inline struct rpn_el *rpn_n(struct stack *st, int idx)
+
+static void compile_jsonpath(struct rpn *me, const char *member)
 {
-	if (idx >= 0 || -idx > st->n) {
-		st->errnum = ECANCELED;
-		return (struct rpn_el *)&dummy;
+	struct jsonpath *path = rpn_priv(me);
+	char *str;
+
+	free_jsonpath(me);
+	path->src = strdup(member);
+	/* array members of the root are named '/N' */
+	path->buf = strdup(*member == '/' ? member+1 : member);
+	path->seg = malloc(sizeof(*path->seg)*(strlen(path->buf)+1));
+	if (!path->src || !path->buf || !path->seg)
+		mylog(LOG_ERR, "malloc json path '%s'", member);
+	for (str = path->buf; str; ) {
+		path->seg[path->nseg++] = str;
+		str = strchr(str, '/');
+		if (str)
+			*str++ = 0;
 	}
-	return st->v+st->n+idx;
 }
 
-/* extract JSON */
-#include "jsmn/jsmn.h"
-static int match_tok(struct rpn *me, const char *needle, const char *json, jsmntok_t *t, const char *topic)
+/* index of the token after the subtree at @i */
+static int json_skip(const jsmntok_t *tok, int ntok, int i)
 {
-	int ntok, j, matched __attribute__((unused));
-	char *newtopic;
-	size_t len;
+	int end = tok[i].end;
 
-	switch (t->type) {
-	case JSMN_PRIMITIVE:
-	case JSMN_STRING:
-		if (!strcmp(needle, topic)) {
-			/* matched */
-			if (me->constvalue)
-				free(me->constvalue);
-			me->constvalue = strndup(json+t->start, t->end - t->start);
-			matched = 1;
-		} else {
-			matched = 0;
-		}
-		//printf("%s\t%c\t%.*s\n", topic, matched ? '*' : ' ', t->end - t->start, json + t->start);
-		return 1;
-	case JSMN_OBJECT:
-		newtopic = NULL;
-		len = 0;
-		ntok = 1;
-		for (j = 0; j < t->size; ++j) {
-			if (t[ntok].type != JSMN_STRING)
-				mylog(LOG_ERR, "property with non-string name");
-			if (strlen(topic) + t[ntok].end - t[ntok].start + 1 > len) {
-				len = (strlen(topic) + t[ntok].end - t[ntok].start + 1 + 128) & ~127;
-				newtopic = realloc(newtopic, len);
-				if (!newtopic)
-					mylog(LOG_ERR, "realloc %li: %s", (long)len, ESTR(errno));
+	for (++i; i < ntok && tok[i].start < end; ++i);
+	return i;
+}
+
+/* find the value at @path, stop at the first match */
+static int json_find(const char *json, const jsmntok_t *tok, int ntok, const struct jsonpath *path)
+{
+	int i, j, k, n, len;
+	char *endp;
+
+	for (i = k = 0; k < path->nseg; ++k) {
+		n = tok[i].size;
+		if (tok[i].type == JSMN_OBJECT) {
+			len = strlen(path->seg[k]);
+			for (++i, j = 0; j < n; ++j) {
+				if (tok[i].end - tok[i].start == len &&
+						!strncmp(json+tok[i].start, path->seg[k], len))
+					break;
+				/* skip name & value */
+				i = json_skip(tok, ntok, i+1);
 			}
-			sprintf(newtopic, "%s%s%.*s", topic, topic[0] ? "/" : "", t[ntok].end - t[ntok].start, json + t[ntok].start);
-			++ntok;
-			ntok += match_tok(me, needle, json, t+ntok, newtopic);
-		}
-		if (newtopic)
-			free(newtopic);
-		return ntok;
-	case JSMN_ARRAY:
-		newtopic = malloc(strlen(topic) + 16);
-		ntok = 1;
-		for (j = 0; j < t->size; ++j) {
-			sprintf(newtopic, "%s/%i", topic, j);
-			ntok += match_tok(me, needle, json, t+ntok, newtopic);
-		}
-		free(newtopic);
-		return ntok;
-	default:
-		return 0;
+			if (j >= n)
+				return -1;
+			/* value follows the name */
+			++i;
+		} else if (tok[i].type == JSMN_ARRAY) {
+			j = strtoul(path->seg[k], &endp, 10);
+			if (endp == path->seg[k] || *endp || j >= n)
+				return -1;
+			for (++i; j; --j)
+				i = json_skip(tok, ntok, i);
+		} else
+			return -1;
+		if (i >= ntok)
+			return -1;
+	}
+	if (tok[i].type != JSMN_PRIMITIVE && tok[i].type != JSMN_STRING)
+		return -1;
+	return i;
+}
+
+/* tokenize @json, or reuse the tokens of the previous json op */
+static int json_tokenize(struct stack *st, const char *json)
+{
+	struct rpn_jsoncache *c = st->json;
+	jsmn_parser prs;
+	int len, ret;
+
+	if (!c) {
+		c = st->json = malloc(sizeof(*c));
+		if (!c)
+			mylog(LOG_ERR, "malloc json cache");
+		memset(c, 0, sizeof(*c));
+	}
+	if (!c->tok) {
+		/* jsmn only counts without token array */
+		c->tokcnt = 64;
+		c->tok = malloc(sizeof(*c->tok)*c->tokcnt);
+		if (!c->tok)
+			mylog(LOG_ERR, "malloc json tokens %i", c->tokcnt);
+	}
+	len = strlen(json);
+	if (c->json == json && c->len == len)
+		return c->ntok;
+	c->json = NULL;
+	for (;;) {
+		jsmn_init(&prs);
+		ret = jsmn_parse(&prs, json, len, c->tok, c->tokcnt);
+		if (ret != JSMN_ERROR_NOMEM)
+			break;
+		c->tokcnt *= 2;
+		c->tok = realloc(c->tok, sizeof(*c->tok)*c->tokcnt);
+		if (!c->tok)
+			mylog(LOG_ERR, "realloc json tokens %i", c->tokcnt);
 	}
+	if (ret < 0)
+		return ret;
+	c->json = json;
+	c->len = len;
+	c->ntok = ret;
+	return ret;
 }
 
 static void rpn_do_json(struct stack *st, struct rpn *me)
 {
+	struct jsonpath *path = rpn_priv(me);
 	const char *member = rpn_pop1(st)->a;
 	const char *json = rpn_pop1(st)->a;
+	const jsmntok_t *tok;
+	const char *match;
+	int ret;
 
 	if (!json || !member)
 		goto failed;
 
-	/* start parsing */
-	jsmn_parser prs;
-	static jsmntok_t *tok;
-	static size_t tokcnt;
-	int len, ret;
-
-	len = strlen(json);
-	jsmn_init(&prs);
-	ret = jsmn_parse(&prs, json, len, NULL, 0);
+	ret = json_tokenize(st, json);
 	if (ret < 0) {
 		st->errnum = -ret;
 		goto failed;
 	}
-
-	jsmn_init(&prs);
-	if (ret > tokcnt) {
-		tokcnt = (ret + 7) & ~7;
-		tok = realloc(tok, sizeof(*tok)*tokcnt);
-	}
-	ret = jsmn_parse(&prs, json, len, tok, tokcnt);
-	if (ret < 0) {
-		st->errnum = -ret;
+	if (!ret)
 		goto failed;
+	if (!path->src || strcmp(path->src, member))
+		compile_jsonpath(me, member);
+	tok = st->json->tok;
+	ret = json_find(json, tok, st->json->ntok, path);
+	if (ret < 0) {
+		rpn_push_str(st, NULL, NAN);
+		return;
 	}
-	if (me->constvalue)
-		free(me->constvalue);
-	me->constvalue = NULL;
-	match_tok(me, member, json, tok, "");
-	rpn_push_str(st, me->constvalue, mystrtod(me->constvalue ?: "nan", NULL));
+	match = rpn_strndup(st, json+tok[ret].start, tok[ret].end - tok[ret].start);
+	rpn_push_str(st, match, mystrtod(match, NULL));
 	return;
 
 failed:
 	rpn_push_str(st, "", NAN);
 }
 
+/* build JSON objects */
+struct jsonobj {
+	/* "name": preformatted, with ',' before all but the first */
+	struct jsonkey {
+		char *str;
+		int len;
+	} *keys;
+	int nkeys;
+};
+
+static const char *json_skipdigits(const char *str, const char *end)
+{
+	while (str < end && *str >= '0' && *str <= '9')
+		++str;
+	return str;
+}
+
+/* @str of @len is a JSON number */
+static int json_isnumber(const char *str, int len)
+{
+	const char *end = str + len, *pos;
+
+	if (str < end && *str == '-')
+		++str;
+	pos = json_skipdigits(str, end);
+	if (pos == str || (*str == '0' && pos > str+1))
+		return 0;
+	if (pos < end && *pos == '.') {
+		str = pos+1;
+		pos = json_skipdigits(str, end);
+		if (pos == str)
+			return 0;
+	}
+	if (pos < end && (*pos == 'e' || *pos == 'E')) {
+		str = pos+1;
+		if (str < end && (*str == '+' || *str == '-'))
+			++str;
+		pos = json_skipdigits(str, end);
+		if (pos == str)
+			return 0;
+	}
+	return pos == end;
+}
+
+/* validate the subtree at @i, return the next token or -1
+ * jsmn is not strict, it accepts i.e. {x}
+ */
+static int json_check(const char *json, const jsmntok_t *tok, int ntok, int i)
+{
+	const char *str;
+	int j, n, len;
+
+	if (i >= ntok)
+		return -1;
+	n = tok[i].size;
+	switch (tok[i].type) {
+	case JSMN_OBJECT:
+		for (++i, j = 0; j < n; ++j) {
+			/* name, with its value as child */
+			if (i >= ntok || tok[i].type != JSMN_STRING || tok[i].size != 1)
+				return -1;
+			i = json_check(json, tok, ntok, i+1);
+			if (i < 0)
+				return -1;
+		}
+		return i;
+	case JSMN_ARRAY:
+		for (++i, j = 0; j < n; ++j) {
+			i = json_check(json, tok, ntok, i);
+			if (i < 0)
+				return -1;
+		}
+		return i;
+	case JSMN_STRING:
+		return i+1;
+	case JSMN_PRIMITIVE:
+		str = json + tok[i].start;
+		len = tok[i].end - tok[i].start;
+		if (json_isnumber(str, len) ||
+				(len == 4 && (!strncmp(str, "true", 4) || !strncmp(str, "null", 4))) ||
+				(len == 5 && !strncmp(str, "false", 5)))
+			return i+1;
+		return -1;
+	default:
+		return -1;
+	}
+}
+
+/* a valid object or array, i.e. from json or jsonobj */
+static int json_isnested(struct stack *st, const char *str, int len)
+{
+	const jsmntok_t *tok;
+	int ntok;
+
+	if (*str != '{' && *str != '[')
+		return 0;
+	ntok = json_tokenize(st, str);
+	if (ntok <= 0)
+		return 0;
+	tok = st->json->tok;
+	/* 1 root that covers all */
+	return tok[0].start == 0 && tok[0].end == len &&
+		json_check(str, tok, ntok, 0) == ntok;
+}
+
+/* write @str quoted into @out when not NULL, return the length */
+static int json_putstr(char *out, const char *str)
+{
+	int len = 0, c;
+
+	if (out)
+		out[len] = '"';
+	++len;
+	for (; *str; ++str) {
+		c = *str & 0xff;
+		if (c == '"' || c == '\\') {
+			if (out) {
+				out[len] = '\\';
+				out[len+1] = c;
+			}
+			len += 2;
+		} else if (c < 0x20) {
+			if (out)
+				sprintf(out+len, "\\u%04x", c);
+			len += 6;
+		} else {
+			if (out)
+				out[len] = c;
+			++len;
+		}
+	}
+	if (out)
+		out[len] = '"';
+	return len+1;
+}
+
+/* write @el into @out, return the length
+ * When @out is NULL, return an upper bound.
+ * NaN & empty strings become null.
+ */
+static int json_putvalue(struct stack *st, char *out, const struct rpn_el *el)
+{
+	const char *str;
+	int len;
+
+	if (el->a && *el->a) {
+		len = strlen(el->a);
+		if (!json_isnumber(el->a, len) && !json_isnested(st, el->a, len))
+			return json_putstr(out, el->a);
+		str = el->a;
+	} else if (el->a || !isfinite(el->d)) {
+		str = "null";
+		len = 4;
+	} else if (!out) {
+		/* mydtostr's %lg does not exceed this */
+		return 16;
+	} else {
+		str = mydtostr(el->d);
+		len = strlen(str);
+	}
+	if (out)
+		memcpy(out, str, len);
+	return len;
+}
+
+static void free_jsonobj(struct rpn *me)
+{
+	struct jsonobj *priv = rpn_priv(me);
+	int j;
+
+	for (j = 0; j < priv->nkeys; ++j)
+		free(priv->keys[j].str);
+	if (priv->keys)
+		free(priv->keys);
+}
+
+static int parse_jsonobj(struct rpn *me, const char *str, int len)
+{
+	struct jsonobj *priv = rpn_priv(me);
+	const char *end = str + len, *sep;
+	struct jsonkey *key;
+	char *name;
+	int j;
+
+	if (!str)
+		return 0;
+	for (; str < end; str = sep+1) {
+		sep = memchr(str, ',', end - str) ?: end;
+		if (sep == str)
+			continue;
+		priv->keys = realloc(priv->keys, sizeof(*priv->keys)*(priv->nkeys+1));
+		if (!priv->keys)
+			mylog(LOG_ERR, "realloc jsonobj %i: %s", priv->nkeys+1, ESTR(errno));
+		key = priv->keys + priv->nkeys;
+		name = strndup(str, sep - str);
+		/* ',' "name" ':' */
+		key->str = malloc(json_putstr(NULL, name) + 3);
+		if (!name || !key->str)
+			mylog(LOG_ERR, "malloc jsonobj key: %s", ESTR(errno));
+		key->len = 0;
+		if (priv->nkeys)
+			key->str[key->len++] = ',';
+		key->len += json_putstr(key->str + key->len, name);
+		key->str[key->len++] = ':';
+		key->str[key->len] = 0;
+		free(name);
+		for (j = 0; j < priv->nkeys; ++j) {
+			/* compare without the ',' */
+			if (!strcmp(priv->keys[j].str + !!j, key->str + !!priv->nkeys)) {
+				mylog(LOG_INFO | LOG_MQTT, "jsonobj: name %.*s duplicated",
+						key->len - !!priv->nkeys - 1, key->str + !!priv->nkeys);
+				free(key->str);
+				return -1;
+			}
+		}
+		++priv->nkeys;
+	}
+	/* 1 value per name */
+	me->pops = priv->nkeys;
+	return 0;
+}
+
+static void rpn_do_jsonobj(struct stack *st, struct rpn *me)
+{
+	struct jsonobj *priv = rpn_priv(me);
+	struct rpn_el *vals = rpn_n(st, -priv->nkeys);
+	char *buf;
+	int j, len;
+
+	for (j = 0, len = 2; j < priv->nkeys; ++j)
+		len += priv->keys[j].len + json_putvalue(st, NULL, vals+j);
+	buf = rpn_stralloc(st, len+1);
+	len = 0;
+	buf[len++] = '{';
+	for (j = 0; j < priv->nkeys; ++j) {
+		memcpy(buf+len, priv->keys[j].str, priv->keys[j].len);
+		len += priv->keys[j].len;
+		len += json_putvalue(st, buf+len, vals+j);
+	}
+	buf[len++] = '}';
+	buf[len] = 0;
+	rpn_strtrim(st, buf);
+	rpn_pop(st, priv->nkeys);
+	rpn_push_str(st, buf, NAN);
+}
+
 /* algebra */
 static void rpn_do_plus(struct stack *st, struct rpn *me)
 {
@@ -377,6 +792,94 @@ static void rpn_do_ramp3(struct stack *st, struct rpn *me)
 	rpn_push(st, value);
 }
 
+/* piecewise linear interpolation, on a table of x,y points */
+struct interp {
+	struct interp_pt {
+		double x, y;
+	} *pts;
+	int n, s;
+};
+
+static void free_interp(struct rpn *me)
+{
+	struct interp *priv = rpn_priv(me);
+
+	if (priv->pts)
+		free(priv->pts);
+}
+
+static int parse_interp(struct rpn *me, const char *str, int len)
+{
+	struct interp *priv = rpn_priv(me);
+	const char *end = str + len, *sep;
+	double val[2];
+	int nval = 0, j, ok;
+
+	if (!str)
+		return 0;
+	for (; str < end; str = sep+1) {
+		sep = memchr(str, ',', end - str) ?: end;
+		if (sep == str)
+			continue;
+		val[nval++] = rpn_strntod(str, sep - str, &ok);
+		if (!ok) {
+			mylog(LOG_INFO | LOG_MQTT, "interp: bad number '%.*s'", (int)(sep - str), str);
+			return -1;
+		}
+		if (nval < 2)
+			continue;
+		nval = 0;
+		if (priv->n >= priv->s) {
+			priv->s += 16;
+			priv->pts = realloc(priv->pts, sizeof(*priv->pts)*priv->s);
+			if (!priv->pts)
+				mylog(LOG_ERR, "realloc interp %i: %s", priv->s, ESTR(errno));
+		}
+		/* insert sorted on x, equal x keep their order */
+		for (j = priv->n; j > 0 && priv->pts[j-1].x > val[0]; --j)
+			priv->pts[j] = priv->pts[j-1];
+		priv->pts[j].x = val[0];
+		priv->pts[j].y = val[1];
+		++priv->n;
+	}
+	if (nval) {
+		mylog(LOG_INFO | LOG_MQTT, "interp: x %s without y", mydtostr(val[0]));
+		return -1;
+	}
+	return 0;
+}
+
+static void rpn_do_interp(struct stack *st, struct rpn *me)
+{
+	struct interp *priv = rpn_priv(me);
+	const struct interp_pt *pts = priv->pts;
+	double x = rpn_pop1(st)->d;
+	int lo, hi, mid;
+
+	if (!priv->n || isnan(x)) {
+		rpn_push(st, NAN);
+		return;
+	}
+	/* clamp outside the table */
+	if (x <= pts[0].x) {
+		rpn_push(st, pts[0].y);
+		return;
+	}
+	if (x >= pts[priv->n-1].x) {
+		rpn_push(st, pts[priv->n-1].y);
+		return;
+	}
+	/* find pts[lo].x <= x < pts[hi].x */
+	for (lo = 0, hi = priv->n-1; hi - lo > 1; ) {
+		mid = (lo + hi) / 2;
+		if (pts[mid].x <= x)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	rpn_push(st, pts[lo].y + (x - pts[lo].x)*(pts[hi].y - pts[lo].y)/(pts[hi].x - pts[lo].x));
+}
+
 static void rpn_do_hyst2(struct stack *st, struct rpn *me)
 {
 	struct rpn_el *dut = rpn_n(st, -3);
@@ -449,7 +952,7 @@ static void rpn_do_avgtime(struct stack *st, struct rpn *me)
 
 		} else {
 			/* schedule summary on next period */
-			next = period - fmod(walltime(), period);
+			next = period - fmod(libt_walltime(), period);
 			libt_add_timeout(next, on_avgtime_period, me);
 			me->timeout = on_avgtime_period;
 		}
@@ -468,54 +971,265 @@ static void rpn_do_avgtime(struct stack *st, struct rpn *me)
 	rpn_push(st, avg->out);
 }
 
+/* running window
+ * Samples live in a circular buffer, head & tail count forever.
+ * The time-weighted sum is updated incrementally,
+ * min & max are the front of a monotonic deque of sample indices.
+ * When the window exceeds its budget, older samples are merged
+ * into buckets of fixed time.
+ */
+#define RUNNING_BUDGET	4096
+/* the tables grow to twice the budget */
+#define RUNNING_BUDGET_MIN	8
+#define RUNNING_BUDGET_MAX	(1 << 20)
+
+/* parse the optional sample budget, as in 'ravg,N' */
+static int parse_budget(const char *str, int len, unsigned int *pbudget)
+{
+	double budget;
+	int ok;
+
+	if (!str) {
+		*pbudget = RUNNING_BUDGET;
+		return 0;
+	}
+	budget = rpn_strntod(str, len, &ok);
+	if (!ok || budget != floor(budget) || budget < RUNNING_BUDGET_MIN || budget > RUNNING_BUDGET_MAX) {
+		mylog(LOG_INFO | LOG_MQTT, "budget '%.*s' not in %i..%i", len, str,
+				RUNNING_BUDGET_MIN, RUNNING_BUDGET_MAX);
+		return -1;
+	}
+	*pbudget = budget;
+	return 0;
+}
+
 struct running {
 	struct sample {
-		double t;
-		double v;
+		double t; /* first sample */
+		double tlast; /* last sample */
+		double v; /* value of the last sample */
+		double isum; /* time-weighted sum between t & tlast */
+		/* min & max since the last NaN, NaN when v is NaN */
+		double min, max;
+		int hasnan;
 	} *table;
-	int tsize, tfill, told;
+	unsigned int *dmin, *dmax; /* deques, same size as table */
+	unsigned int size; /* power of 2 */
+	unsigned int head, tail; /* oldest, 1 past newest sample */
+	unsigned int minhead, mintail, maxhead, maxtail;
+	/* sum of the slices between samples */
+	double sum;
+	int nonfinite; /* slices not in sum */
+	unsigned int nupdates; /* since the last resync of sum */
+	unsigned int budget; /* max. number of samples */
 };
 
+static int parse_running(struct rpn *me, const char *str, int len)
+{
+	struct running *run = rpn_priv(me);
+
+	return parse_budget(str, len, &run->budget);
+}
+
 static void free_running(struct rpn *me)
 {
 	struct running *run = rpn_priv(me);
 
 	if (run->table)
 		free(run->table);
+	if (run->dmin)
+		free(run->dmin);
+	if (run->dmax)
+		free(run->dmax);
+}
+
+static inline struct sample *running_sample(struct running *run, unsigned int idx)
+{
+	return run->table + (idx & (run->size-1));
+}
+
+/* time-weighted value from sample @idx until @t */
+static inline double running_slice(struct running *run, unsigned int idx, double t)
+{
+	struct sample *s = running_sample(run, idx);
+
+	return s->isum + (isnan(s->v) ? 0 : (t - s->tlast) * s->v);
+}
+
+static void running_add_slice(struct running *run, double slice, int sign)
+{
+	if (!isfinite(slice))
+		run->nonfinite += sign;
+	else
+		run->sum += sign*slice;
+}
+
+/* sum of the slices, computed from scratch */
+static double running_resum(struct running *run)
+{
+	unsigned int j;
+	double sum = 0;
+
+	for (j = run->head; j+1 != run->tail; ++j)
+		sum += running_slice(run, j, running_sample(run, j+1)->t);
+	return sum;
+}
+
+static void running_resync(struct running *run)
+{
+	unsigned int j;
+
+	run->sum = 0;
+	run->nonfinite = 0;
+	for (j = run->head; j+1 != run->tail; ++j)
+		running_add_slice(run, running_slice(run, j, running_sample(run, j+1)->t), +1);
+	run->nupdates = 0;
+}
+
+static void running_grow(struct running *run)
+{
+	unsigned int newsize = run->size*2 ?: 32, j;
+	struct sample *table;
+	unsigned int *dmin, *dmax;
+
+	table = malloc(sizeof(*table)*newsize);
+	dmin = malloc(sizeof(*dmin)*newsize);
+	dmax = malloc(sizeof(*dmax)*newsize);
+	if (!table || !dmin || !dmax)
+		mylog(LOG_ERR, "malloc running window %u", newsize);
+	for (j = run->head; j != run->tail; ++j)
+		table[j & (newsize-1)] = *running_sample(run, j);
+	for (j = run->minhead; j != run->mintail; ++j)
+		dmin[j & (newsize-1)] = run->dmin[j & (run->size-1)];
+	for (j = run->maxhead; j != run->maxtail; ++j)
+		dmax[j & (newsize-1)] = run->dmax[j & (run->size-1)];
+	if (run->table) {
+		free(run->table);
+		free(run->dmin);
+		free(run->dmax);
+	}
+	run->table = table;
+	run->dmin = dmin;
+	run->dmax = dmax;
+	run->size = newsize;
+}
+
+/* append @idx to a deque, drop the entries it supersedes */
+static void running_push_deque(struct running *run, unsigned int *dq,
+		unsigned int *phead, unsigned int *ptail, unsigned int idx, int max)
+{
+	struct sample *s = running_sample(run, idx);
+	double v = max ? s->max : s->min, w;
+
+	if (s->hasnan)
+		/* NaN restarts min & max */
+		*phead = *ptail = idx;
+	if (isnan(v))
+		return;
+	for (; *ptail != *phead; --*ptail) {
+		s = running_sample(run, dq[(*ptail-1) & (run->size-1)]);
+		w = max ? s->max : s->min;
+		if (max ? (w > v) : (w < v))
+			break;
+	}
+	dq[(*ptail)++ & (run->size-1)] = idx;
+}
+
+static void running_pop_deque(struct running *run, unsigned int *dq,
+		unsigned int *phead, unsigned int *ptail)
+{
+	/* drop indices before run->head */
+	while (*phead != *ptail && (int)(dq[*phead & (run->size-1)] - run->head) < 0)
+		++*phead;
+}
+
+/* merge @e into bucket @b */
+static void running_merge(struct sample *b, const struct sample *e)
+{
+	if (!isnan(b->v))
+		b->isum += (e->t - b->tlast) * b->v;
+	b->isum += e->isum;
+	b->tlast = e->tlast;
+	b->v = e->v;
+	if (e->hasnan) {
+		b->min = e->min;
+		b->max = e->max;
+		b->hasnan = 1;
+	} else {
+		if (isnan(b->min) || !(e->min > b->min))
+			b->min = e->min;
+		if (isnan(b->max) || !(e->max < b->max))
+			b->max = e->max;
+	}
+}
+
+/* merge all but the newest sample into buckets of fixed time */
+static void running_compact(struct running *run, double period)
+{
+	double width = period*2/run->budget;
+	struct sample *b, *e;
+	unsigned int in, out;
+
+	if (!(width > 0))
+		return;
+	out = run->head;
+	for (in = run->head+1; in+1 != run->tail; ++in) {
+		b = running_sample(run, out);
+		e = running_sample(run, in);
+		if (floor(b->t / width) == floor(e->t / width))
+			running_merge(b, e);
+		else
+			*running_sample(run, ++out) = *e;
+	}
+	*running_sample(run, ++out) = *running_sample(run, in);
+	run->tail = out+1;
+
+	/* rebuild */
+	run->minhead = run->mintail = run->maxhead = run->maxtail = run->head;
+	for (in = run->head; in != run->tail; ++in) {
+		running_push_deque(run, run->dmin, &run->minhead, &run->mintail, in, 0);
+		running_push_deque(run, run->dmax, &run->maxhead, &run->maxtail, in, 1);
+	}
+	running_resync(run);
 }
 
 static void rpn_collect_running(struct rpn *me, double now, double period, double value)
 {
 	struct running *run = rpn_priv(me);
+	struct sample *s;
 	double from;
-	int j;
 
 	from = now - period;
 
-	/* clean history */
-	for (j = run->told; j < run->tfill; ++j) {
-		if (run->table[j].t > from)
-			break;
+	/* clean history, keep the last sample before @from */
+	while (run->tail - run->head > 1 && running_sample(run, run->head+1)->t <= from) {
+		running_add_slice(run, running_slice(run, run->head,
+					running_sample(run, run->head+1)->t), -1);
+		++run->head;
 	}
-	if (j > run->told)
-		--j;
-	run->told = j;
+	running_pop_deque(run, run->dmin, &run->minhead, &run->mintail);
+	running_pop_deque(run, run->dmax, &run->maxhead, &run->maxtail);
 
 	/* add storage */
-	if (run->tfill >= run->tsize && run->told) {
-		memmove(run->table, run->table+run->told,
-				(run->tfill-run->told)*sizeof(run->table[0]));
-		run->tfill -= run->told;
-		run->told = 0;
-	}
-	if (run->tfill >= run->tsize) {
-		run->tsize = run->tsize*2 ?: 32;
-		run->table = realloc(run->table, sizeof(run->table[0])*run->tsize);
-	}
-
-	run->table[run->tfill].t = now;
-	run->table[run->tfill].v = value;
-	++run->tfill;
+	if (run->tail - run->head >= run->size)
+		running_grow(run);
+
+	if (run->tail != run->head)
+		running_add_slice(run, running_slice(run, run->tail-1, now), +1);
+	s = running_sample(run, run->tail);
+	s->t = s->tlast = now;
+	s->v = s->min = s->max = value;
+	s->isum = 0;
+	s->hasnan = isnan(value);
+	running_push_deque(run, run->dmin, &run->minhead, &run->mintail, run->tail, 0);
+	running_push_deque(run, run->dmax, &run->maxhead, &run->maxtail, run->tail, 1);
+	++run->tail;
+
+	if (run->tail - run->head > run->budget)
+		running_compact(run, period);
+	/* avoid drifting of the incremental sum */
+	else if (++run->nupdates >= run->size)
+		running_resync(run);
 }
 
 static void rpn_do_running_avg(struct stack *st, struct rpn *me)
@@ -523,7 +1237,6 @@ static void rpn_do_running_avg(struct stack *st, struct rpn *me)
 	struct running *run = rpn_priv(me);
 	double v, period;
 	double now;
-	int j;
 	double sum;
 
 	period = rpn_pop1(st)->d;
@@ -532,16 +1245,11 @@ static void rpn_do_running_avg(struct stack *st, struct rpn *me)
 
 	rpn_collect_running(me, now, period, v);
 
-	sum = 0;
-	for (j = run->told+1; j < run->tfill; ++j) {
-		if (!isnan(run->table[j-1].v))
-			sum += (run->table[j].t - run->table[j-1].t) * run->table[j-1].v;
-	}
+	sum = run->nonfinite ? running_resum(run) : run->sum;
 	/* append current slice */
-	if (!isnan(run->table[j-1].v))
-		sum += (now - run->table[j-1].t) * run->table[j-1].v;
+	sum += running_slice(run, run->tail-1, now);
 
-	rpn_push(st, sum/(now - run->table[run->told].t));
+	rpn_push(st, sum/(now - running_sample(run, run->head)->t));
 }
 
 static void rpn_do_running_min(struct stack *st, struct rpn *me)
@@ -549,7 +1257,6 @@ static void rpn_do_running_min(struct stack *st, struct rpn *me)
 	struct running *run = rpn_priv(me);
 	double v, period;
 	double now;
-	int j;
 
 	period = rpn_pop1(st)->d;
 	v = rpn_pop1(st)->d;
@@ -558,12 +1265,8 @@ static void rpn_do_running_min(struct stack *st, struct rpn *me)
 
 	rpn_collect_running(me, now, period, v);
 
-	v = run->table[run->told].v;
-	for (j = run->told+1; j < run->tfill; ++j) {
-		if (!(run->table[j].v > v))
-			v = run->table[j].v;
-	}
-
+	if (run->minhead != run->mintail)
+		v = running_sample(run, run->dmin[run->minhead & (run->size-1)])->min;
 	rpn_push(st, v);
 }
 
@@ -572,7 +1275,6 @@ static void rpn_do_running_max(struct stack *st, struct rpn *me)
 	struct running *run = rpn_priv(me);
 	double v, period;
 	double now;
-	int j;
 
 	period = rpn_pop1(st)->d;
 	v = rpn_pop1(st)->d;
@@ -581,13 +1283,282 @@ static void rpn_do_running_max(struct stack *st, struct rpn *me)
 
 	rpn_collect_running(me, now, period, v);
 
-	v = run->table[run->told].v;
-	for (j = run->told+1; j < run->tfill; ++j) {
-		if (!(run->table[j].v < v))
-			v = run->table[j].v;
+	if (run->maxhead != run->maxtail)
+		v = running_sample(run, run->dmax[run->maxhead & (run->size-1)])->max;
+	rpn_push(st, v);
+}
+
+/* running order statistics
+ * Values of the window are kept sorted in an indexable skip list:
+ * each link knows how many values it skips, so insert, remove
+ * and the value of rank n take O(log n).
+ * Samples live in a circular buffer for the time window,
+ * NaN values take no place in the skip list.
+ */
+#define SKIP_MAXLEVEL	10
+
+struct skipnode {
+	double v;
+	int level;
+	struct skiplink {
+		struct skipnode *next;
+		int width; /* values skipped by this link */
+	} link[];
+};
+
+struct ostat {
+	struct skipnode *skip; /* head of the skip list */
+	/* removed nodes, per level, linked via link[0] */
+	struct skipnode *free[SKIP_MAXLEVEL+1];
+	int n; /* values in the skip list */
+	unsigned int rnd;
+	struct osample {
+		double t, v;
+	} *table;
+	unsigned int size; /* power of 2 */
+	unsigned int head, tail; /* oldest, 1 past newest sample */
+	unsigned int budget; /* max. number of samples */
+};
+
+static int parse_ostat(struct rpn *me, const char *str, int len)
+{
+	struct ostat *os = rpn_priv(me);
+
+	return parse_budget(str, len, &os->budget);
+}
+
+static void free_skipnodes(struct skipnode *node, int level)
+{
+	struct skipnode *next;
+
+	for (; node; node = next) {
+		next = node->link[level].next;
+		free(node);
 	}
+}
 
-	rpn_push(st, v);
+static void free_ostat(struct rpn *me)
+{
+	struct ostat *os = rpn_priv(me);
+	int j;
+
+	if (os->skip) {
+		free_skipnodes(os->skip->link[0].next, 0);
+		free(os->skip);
+	}
+	for (j = 1; j <= SKIP_MAXLEVEL; ++j)
+		free_skipnodes(os->free[j], 0);
+	if (os->table)
+		free(os->table);
+}
+
+static struct skipnode *skip_alloc(struct ostat *os, int level)
+{
+	struct skipnode *node = os->free[level];
+
+	if (node) {
+		os->free[level] = node->link[0].next;
+		return node;
+	}
+	node = malloc(sizeof(*node) + sizeof(node->link[0])*level);
+	if (!node)
+		mylog(LOG_ERR, "malloc skip node %i", level);
+	node->level = level;
+	return node;
+}
+
+/* level 1..SKIP_MAXLEVEL, each next level with chance 1/4 */
+static int skip_level(struct ostat *os)
+{
+	int level;
+
+	/* xorshift */
+	os->rnd ^= os->rnd << 13;
+	os->rnd ^= os->rnd >> 17;
+	os->rnd ^= os->rnd << 5;
+	for (level = 1; level < SKIP_MAXLEVEL && !(os->rnd & (3 << (2*level))); ++level);
+	return level;
+}
+
+static void skip_insert(struct ostat *os, double v)
+{
+	struct skipnode *chain[SKIP_MAXLEVEL], *node;
+	int steps[SKIP_MAXLEVEL];
+	int j, level, pos;
+
+	if (!os->skip) {
+		os->skip = skip_alloc(os, SKIP_MAXLEVEL);
+		for (j = 0; j < SKIP_MAXLEVEL; ++j) {
+			os->skip->link[j].next = NULL;
+			os->skip->link[j].width = 1;
+		}
+		os->rnd = 0x9e3779b9;
+	}
+	for (node = os->skip, j = SKIP_MAXLEVEL-1; j >= 0; --j) {
+		steps[j] = 0;
+		for (; node->link[j].next && node->link[j].next->v <= v; node = node->link[j].next)
+			steps[j] += node->link[j].width;
+		chain[j] = node;
+	}
+	level = skip_level(os);
+	node = skip_alloc(os, level);
+	node->v = v;
+	for (j = pos = 0; j < level; ++j) {
+		node->link[j].next = chain[j]->link[j].next;
+		chain[j]->link[j].next = node;
+		node->link[j].width = chain[j]->link[j].width - pos;
+		chain[j]->link[j].width = pos + 1;
+		pos += steps[j];
+	}
+	for (; j < SKIP_MAXLEVEL; ++j)
+		++chain[j]->link[j].width;
+	++os->n;
+}
+
+static void skip_remove(struct ostat *os, double v)
+{
+	struct skipnode *chain[SKIP_MAXLEVEL], *node;
+	int j;
+
+	for (node = os->skip, j = SKIP_MAXLEVEL-1; j >= 0; --j) {
+		for (; node->link[j].next && node->link[j].next->v < v; node = node->link[j].next);
+		chain[j] = node;
+	}
+	node = chain[0]->link[0].next;
+	if (!node || node->v != v)
+		/* not present */
+		return;
+	for (j = 0; j < node->level; ++j) {
+		chain[j]->link[j].width += node->link[j].width - 1;
+		chain[j]->link[j].next = node->link[j].next;
+	}
+	for (; j < SKIP_MAXLEVEL; ++j)
+		--chain[j]->link[j].width;
+	--os->n;
+	node->link[0].next = os->free[node->level];
+	os->free[node->level] = node;
+}
+
+/* value of rank @idx, 0 is the lowest */
+static double skip_at(struct ostat *os, int idx)
+{
+	struct skipnode *node = os->skip;
+	int j;
+
+	++idx;
+	for (j = SKIP_MAXLEVEL-1; j >= 0; --j) {
+		for (; node->link[j].width <= idx; node = node->link[j].next)
+			idx -= node->link[j].width;
+	}
+	return node->v;
+}
+
+static inline struct osample *ostat_sample(struct ostat *os, unsigned int idx)
+{
+	return os->table + (idx & (os->size-1));
+}
+
+static void ostat_drop(struct ostat *os)
+{
+	struct osample *s = ostat_sample(os, os->head++);
+
+	if (!isnan(s->v))
+		skip_remove(os, s->v);
+}
+
+static void ostat_grow(struct ostat *os)
+{
+	unsigned int newsize = os->size*2 ?: 32, j;
+	struct osample *table;
+
+	table = malloc(sizeof(*table)*newsize);
+	if (!table)
+		mylog(LOG_ERR, "malloc order statistics %u", newsize);
+	for (j = os->head; j != os->tail; ++j)
+		table[j & (newsize-1)] = *ostat_sample(os, j);
+	if (os->table)
+		free(os->table);
+	os->table = table;
+	os->size = newsize;
+}
+
+static void rpn_collect_ostat(struct rpn *me, double now, double period, double value)
+{
+	struct ostat *os = rpn_priv(me);
+	struct osample *s;
+
+	/* keep the last sample before the window, as running windows do */
+	while (os->tail - os->head > 1 && ostat_sample(os, os->head+1)->t <= now - period)
+		ostat_drop(os);
+	while (os->tail - os->head >= os->budget)
+		ostat_drop(os);
+	if (os->tail - os->head >= os->size)
+		ostat_grow(os);
+	s = ostat_sample(os, os->tail++);
+	s->t = now;
+	s->v = value;
+	if (!isnan(value))
+		skip_insert(os, value);
+}
+
+/* percentile @p of the window, interpolated between ranks */
+static double ostat_percentile(struct ostat *os, double p)
+{
+	double rank, lo;
+	int idx;
+
+	if (!os->n || isnan(p))
+		return NAN;
+	if (p < 0)
+		p = 0;
+	else if (p > 1)
+		p = 1;
+	rank = p * (os->n - 1);
+	idx = rank;
+	lo = skip_at(os, idx);
+	if (idx+1 >= os->n || rank == idx)
+		return lo;
+	return lo + (rank - idx) * (skip_at(os, idx+1) - lo);
+}
+
+static void rpn_do_running_median(struct stack *st, struct rpn *me)
+{
+	double v, period;
+
+	period = rpn_pop1(st)->d;
+	v = rpn_pop1(st)->d;
+	rpn_collect_ostat(me, libt_now(), period, v);
+	rpn_push(st, ostat_percentile(rpn_priv(me), 0.5));
+}
+
+static void rpn_do_running_percentile(struct stack *st, struct rpn *me)
+{
+	double v, period, p;
+
+	p = rpn_pop1(st)->d;
+	period = rpn_pop1(st)->d;
+	v = rpn_pop1(st)->d;
+	rpn_collect_ostat(me, libt_now(), period, v);
+	rpn_push(st, ostat_percentile(rpn_priv(me), p));
+}
+
+/* history */
+static void rpn_do_ago(struct stack *st, struct rpn *me)
+{
+	double delay = rpn_pop1(st)->d;
+
+	/* drop the current value, use the history of its topic */
+	rpn_pop1(st);
+	rpn_push(st, me->topic ? rpn_history_value(me->topic, libt_now() - delay, me) : NAN);
+}
+
+static void rpn_do_integral(struct stack *st, struct rpn *me)
+{
+	double period = rpn_pop1(st)->d;
+	double now = libt_now();
+
+	rpn_pop1(st);
+	rpn_push(st, me->topic ? rpn_history_integral(me->topic, now - period, now, me) : NAN);
 }
 
 struct slope {
@@ -687,20 +1658,24 @@ static void on_slope_step(void *dat)
 	rpn_run_again(dat);
 }
 
-static void parse_slope(struct rpn *me, char *str)
+static int parse_slope(struct rpn *me, const char *str, int len)
 {
 	struct slope *priv = rpn_priv(me);
-	char *tok;
+	const char *end = str + len, *sep;
 
 	if (!str)
-		return;
-	for (tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+		return 0;
+	for (; str < end; str = sep+1) {
+		sep = memchr(str, ',', end - str) ?: end;
+		if (sep == str)
+			continue;
 		if (priv->npos >= priv->spos) {
 			priv->spos += 16;
 			priv->pos = realloc(priv->pos, sizeof(*priv->pos)*priv->spos);
 		}
-		priv->pos[priv->npos++] = mystrtod(tok, NULL);
+		priv->pos[priv->npos++] = rpn_strntod(str, sep - str, NULL);
 	}
+	return 0;
 }
 
 static void rpn_do_slope(struct stack *st, struct rpn *me)
@@ -831,8 +1806,59 @@ static void rpn_do_const(struct stack *st, struct rpn *me)
 
 static void rpn_do_env(struct stack *st, struct rpn *me)
 {
-	const char *str = rpn_lookup_env(me->topic, me);
-	rpn_push_str(st, str, mystrtod(str ?: "nan", NULL));
+	double value = NAN;
+	const char *str = rpn_lookup_env(me->topic, me, &value);
+
+	rpn_push_str(st, str, str ? value : NAN);
+}
+
+/* wildcard aggregates */
+enum {
+	AGGR_COUNT,
+	AGGR_SUM,
+	AGGR_AVG,
+	AGGR_MIN,
+	AGGR_MAX,
+	AGGR_ANY,
+	AGGR_ALL,
+};
+
+static void rpn_do_aggr(struct stack *st, struct rpn *me)
+{
+	const struct rpn_aggr *aggr = rpn_lookup_aggr(me->topic, me);
+	double value;
+
+	if (!aggr) {
+		rpn_push(st, NAN);
+		return;
+	}
+	switch (me->cookie) {
+	case AGGR_COUNT:
+		value = aggr->nmembers;
+		break;
+	case AGGR_SUM:
+		value = aggr->nnum ? aggr->sum : NAN;
+		break;
+	case AGGR_AVG:
+		value = aggr->nnum ? aggr->sum / aggr->nnum : NAN;
+		break;
+	case AGGR_MIN:
+		value = aggr->nnum ? aggr->min : NAN;
+		break;
+	case AGGR_MAX:
+		value = aggr->nnum ? aggr->max : NAN;
+		break;
+	case AGGR_ANY:
+		value = aggr->ntrue > 0;
+		break;
+	case AGGR_ALL:
+		value = aggr->nmembers && aggr->ntrue == aggr->nmembers;
+		break;
+	default:
+		value = NAN;
+		break;
+	}
+	rpn_push(st, value);
 }
 
 static void rpn_do_writeenv(struct stack *st, struct rpn *me)
@@ -1035,10 +2061,7 @@ static void rpn_do_falling(struct stack *st, struct rpn *me)
 }
 static void rpn_do_isnew(struct stack *st, struct rpn *me)
 {
-	if (st->n < 1) {
-		st->errnum = ECANCELED;
-		return;
-	}
+	/* this needs an input, but leaves it on the stack */
 	rpn_push(st, rpn_env_isnew());
 }
 static void on_timeout(void *dat)
@@ -1154,7 +2177,7 @@ static void rpn_do_timeofday(struct stack *st, struct rpn *me)
 	time_t t;
 	struct tm *tm;
 
-	time(&t);
+	t = libt_walltime();
 	tm = localtime(&t);
 	rpn_push(st, tm->tm_hour*3600 + tm->tm_min*60 + tm->tm_sec);
 }
@@ -1164,14 +2187,14 @@ static void rpn_do_dayofweek(struct stack *st, struct rpn *me)
 	time_t t;
 	struct tm *tm;
 
-	time(&t);
+	t = libt_walltime();
 	tm = localtime(&t);
 	rpn_push(st, tm->tm_wday ?: 7 /* push 7 for sunday */);
 }
 
 static void rpn_do_abstime(struct stack *st, struct rpn *me)
 {
-	rpn_push(st, time(NULL));
+	rpn_push(st, floor(libt_walltime()));
 }
 
 static void rpn_do_uptime(struct stack *st, struct rpn *me)
@@ -1195,7 +2218,7 @@ static void rpn_do_uptime(struct stack *st, struct rpn *me)
 
 static void rpn_do_strftime(struct stack *st, struct rpn *me)
 {
-	static char buf[1024];
+	char *buf = rpn_stralloc(st, 1024);
 	struct rpn_el *fmt = rpn_pop1(st);
 	struct rpn_el *t = rpn_pop1(st);
 
@@ -1204,17 +2227,20 @@ static void rpn_do_strftime(struct stack *st, struct rpn *me)
 		stamp = 0;
 	else
 		stamp = t->d;
-	strftime(buf, sizeof(buf), fmt->a, localtime(&stamp));
+	if (!strftime(buf, 1024, fmt->a, localtime(&stamp)))
+		*buf = 0;
+	rpn_strtrim(st, buf);
 	rpn_push_str(st, buf, NAN);
 }
 
 static void rpn_do_delaytostr(struct stack *st, struct rpn *me)
 {
-	static char buf[128];
+	char *buf = rpn_stralloc(st, 128);
 	char *str = buf;
 
 	double value = rpn_pop1(st)->d;
 
+	*buf = 0;
 	if (str > buf || value > 2*7*24*60*60) {
 		str += sprintf(str, "%.0fw", value / (7*24*60*60));
 		value = fmod(value, 7*24*60*60);
@@ -1235,16 +2261,22 @@ static void rpn_do_delaytostr(struct stack *st, struct rpn *me)
 		str += sprintf(str, "%.0fs", value);
 		value = fmod(value, 1);
 	}
+	rpn_strtrim(st, buf);
 	rpn_push_str(st, buf, NAN);
 }
 
 static void rpn_do_fmtvalue(struct stack *st, struct rpn *me)
 {
-	static char buf[128];
 	struct rpn_el *fmt = rpn_pop1(st);
 	struct rpn_el *v = rpn_pop1(st);
-
-	snprintf(buf, sizeof(buf), fmt->a, v->d);
+	char *buf;
+	int len;
+
+	len = snprintf(NULL, 0, fmt->a, v->d);
+	buf = rpn_stralloc(st, (len > 0) ? len+1 : 1);
+	*buf = 0;
+	if (len > 0)
+		sprintf(buf, fmt->a, v->d);
 	rpn_push_str(st, buf, v->d);
 }
 
@@ -1282,10 +2314,53 @@ static void rpn_do_sun(struct stack *st, struct rpn *me)
 
 	struct sunpos pos;
 
-	pos = sun_pos_strous(time(NULL), lat->d, lon->d);
+	pos = sun_pos_cached(libt_walltime(), lat->d, lon->d);
 	rpn_push(st, pos.elevation);
 }
 
+/* sun above an elevation, evaluated only at the crossings */
+struct sunabove {
+	double lat, lon, elv;
+	time_t next; /* next crossing, in wall time */
+	int state;
+	int valid;
+};
+
+static void on_sunabove(void *dat)
+{
+	rpn_run_again(dat);
+}
+
+static void rpn_do_sunabove(struct stack *st, struct rpn *me)
+{
+	struct sunabove *priv = rpn_priv(me);
+	double elv = rpn_pop1(st)->d;
+	double lon = rpn_pop1(st)->d;
+	double lat = rpn_pop1(st)->d;
+	double now = libt_walltime();
+
+	if (isnan(lat) || isnan(lon) || isnan(elv)) {
+		priv->valid = 0;
+		libt_remove_timeout(on_sunabove, me);
+		rpn_push(st, NAN);
+		return;
+	}
+	if (!priv->valid || lat != priv->lat || lon != priv->lon || elv != priv->elv ||
+			now >= priv->next || now < priv->next - 2*86400) {
+		priv->lat = lat;
+		priv->lon = lon;
+		priv->elv = elv;
+		priv->state = sun_pos_strous(now, lat, lon).elevation > elv;
+		/* 1s late, so the elevation has passed elv for sure */
+		priv->next = sun_next_crossing(now, lat, lon, elv) + 1;
+		priv->valid = 1;
+	}
+	/* rearm each time, the wall time may have jumped */
+	libt_add_timeout(priv->next - now, on_sunabove, me);
+	me->timeout = on_sunabove;
+	rpn_push(st, priv->state);
+}
+
 static void rpn_do_sun3(struct stack *st, struct rpn *me)
 {
 	struct rpn_el *lon = rpn_pop1(st);
@@ -1294,6 +2369,7 @@ static void rpn_do_sun3(struct stack *st, struct rpn *me)
 
 	struct sunpos pos;
 
+	/* pure: the cache could return different results */
 	pos = sun_pos_strous(t->d, lat->d, lon->d);
 	rpn_push(st, pos.elevation);
 }
@@ -1328,23 +2404,19 @@ static void rpn_do_celestial_angle(struct stack *st, struct rpn *me)
 	rpn_push(st, angle);
 }
 
-/* flow control */
+/* flow control
+ * These are markers, the interpreter executes them
+ */
 static void rpn_do_if(struct stack *st, struct rpn *me)
 {
-	struct rpn_el *cond = rpn_pop1(st);
-
-	if (!rpn_toint(cond->d))
-		st->jumpto = me->rpn ?: QUIT;
 }
 
 static void rpn_do_else(struct stack *st, struct rpn *me)
 {
-	st->jumpto = me->rpn ?: QUIT;
 }
 
 static void rpn_do_fi(struct stack *st, struct rpn *me)
 {
-	/* this is a marker */
 }
 
 static void rpn_find_fi_else(struct rpn *rpn,
@@ -1393,153 +2465,1346 @@ static void rpn_test_else(struct rpn *me)
 
 static void rpn_do_quit(struct stack *st, struct rpn *me)
 {
-	st->jumpto = QUIT;
+}
+
+/* parser */
+static const struct lookup lookups[] = {
+	{ "+", rpn_do_plus, 2, 1, RPNFN_PURE, },
+	{ "-", rpn_do_minus, 2, 1, RPNFN_PURE, },
+	{ "*", rpn_do_mul, 2, 1, RPNFN_PURE, },
+	{ "/", rpn_do_div, 2, 1, RPNFN_PURE, },
+	{ "%", rpn_do_mod, 2, 1, RPNFN_PURE, },
+	{ "**", rpn_do_pow, 2, 1, RPNFN_PURE, },
+	{ "neg", rpn_do_negative, 1, 1, RPNFN_PURE, },
+
+	{ "&", rpn_do_bitand, 2, 1, RPNFN_PURE, },
+	{ "|", rpn_do_bitor, 2, 1, RPNFN_PURE, },
+	{ "^", rpn_do_bitxor, 2, 1, RPNFN_PURE, },
+	{ "~", rpn_do_bitinv, 1, 1, RPNFN_PURE, },
+
+	{ "&&", rpn_do_booland, 2, 1, RPNFN_PURE, },
+	{ "||", rpn_do_boolor, 2, 1, RPNFN_PURE, },
+	{ "!", rpn_do_boolnot, 1, 1, RPNFN_PURE, },
+	{ "not", rpn_do_boolnot, 1, 1, RPNFN_PURE, },
+	{ "==", rpn_do_intequal, 2, 1, RPNFN_PURE, },
+	{ "!=", rpn_do_intnotequal, 2, 1, RPNFN_PURE, },
+
+	{ "<", rpn_do_lt, 2, 1, RPNFN_PURE, },
+	{ ">", rpn_do_gt, 2, 1, RPNFN_PURE, },
+
+	{ "dup", rpn_do_dup, 1, 2, RPNFN_PURE, },
+	{ "pop", rpn_do_pop, 1, 0, RPNFN_PURE, },
+	{ "swap", rpn_do_swap, 2, 2, RPNFN_PURE, },
+	{ "json", rpn_do_json, 2, 1, 0, sizeof(struct jsonpath),
+		.free = free_jsonpath, },
+	{ "jsonobj", rpn_do_jsonobj, 0, 1, RPNFN_PURE, sizeof(struct jsonobj),
+		.free = free_jsonobj, .parse = parse_jsonobj, }, /* v1 v2 ... jsonobj,name1,name2,... */
+	{ "?:", rpn_do_ifthenelse, 3, 1, RPNFN_PURE, },
+
+	{ "min", rpn_do_min, 2, 1, RPNFN_PURE, },
+	{ "max", rpn_do_max, 2, 1, RPNFN_PURE, },
+	{ "limit", rpn_do_limit, 3, 1, RPNFN_PURE, },
+	{ "inrange", rpn_do_inrange, 3, 1, RPNFN_PURE, },
+	{ "category", rpn_do_category, 2, 1, RPNFN_PURE, },
+	{ "hyst1", rpn_do_hyst1, 3, 1, },
+	{ "hyst2", rpn_do_hyst2, 3, 1, },
+	{ "hyst", rpn_do_hyst2, 3, 1, },
+	{ "throttle", rpn_do_debounce2, 2, 1, },
+	{ "avgtime", rpn_do_avgtime, 2, 1, RPNFN_PERIODIC | RPNFN_WALLTIME, sizeof(struct avgtime), },
+	{ "ravg", rpn_do_running_avg, 2, 1, RPNFN_EVENT, sizeof(struct running),
+		.free = free_running, .parse = parse_running, },
+	{ "rmin", rpn_do_running_min, 2, 1, RPNFN_EVENT, sizeof(struct running),
+		.free = free_running, .parse = parse_running, },
+	{ "rmax", rpn_do_running_max, 2, 1, RPNFN_EVENT, sizeof(struct running),
+		.free = free_running, .parse = parse_running, },
+	{ "rmedian", rpn_do_running_median, 2, 1, RPNFN_EVENT, sizeof(struct ostat),
+		.free = free_ostat, .parse = parse_ostat, },
+	{ "rpercentile", rpn_do_running_percentile, 3, 1, RPNFN_EVENT, sizeof(struct ostat),
+		.free = free_ostat, .parse = parse_ostat, }, /* value period p(0..1) rpercentile */
+	{ "ago", rpn_do_ago, 2, 1, RPNFN_HISTORY, },
+	{ "integral", rpn_do_integral, 2, 1, RPNFN_HISTORY, },
+	{ "ramp3", rpn_do_ramp3, 4, 1, RPNFN_PURE, },
+	{ "interp", rpn_do_interp, 1, 1, RPNFN_PURE, sizeof(struct interp),
+		.free = free_interp, .parse = parse_interp, }, /* x interp,x0,y0,x1,y1,... */
+	{ "slope", rpn_do_slope, 4, 1, 0, sizeof(struct slope),
+		.free = free_slope, .parse = parse_slope, },
+
+	{ "ondelay", rpn_do_ondelay, 2, 1, },
+	{ "offdelay", rpn_do_offdelay, 2, 1, },
+	{ "afterdelay", rpn_do_afterdelay, 2, 1, },
+	{ "debounce", rpn_do_debounce, 2, 1, },
+	{ "debounce2", rpn_do_debounce2, 2, 1, },
+	{ "autoreset", rpn_do_autoreset, 2, 1, },
+
+	{ "isnew", rpn_do_isnew, 1, 2, RPNFN_EVENT, },
+	{ "timeout", rpn_do_timeout, 1, 1, RPNFN_EVENT, },
+	{ "edge", rpn_do_edge, 1, 1, RPNFN_EVENT, },
+	{ "rising", rpn_do_rising, 1, 1, RPNFN_EVENT, },
+	{ "falling", rpn_do_falling, 1, 1, RPNFN_EVENT, },
+	{ "changed", rpn_do_edge, 1, 1, RPNFN_EVENT, },
+	{ "pushed", rpn_do_rising, 1, 1, RPNFN_EVENT, },
+	{ "setreset", rpn_do_setreset, 2, 1, },
+
+	{ "wakeup", rpn_do_wakeup, 1, 0, RPNFN_PERIODIC | RPNFN_WALLTIME, },
+	{ "wakeup2", rpn_do_wakeup2, 1, 1, RPNFN_PERIODIC | RPNFN_WALLTIME, },
+	{ "delta", rpn_do_delta, 3, 1, RPNFN_PERIODIC | RPNFN_WALLTIME,
+		.xpushes = 2, },
+	{ "delta2", rpn_do_delta2, 4, 1, RPNFN_PERIODIC,
+		.xpushes = 2, },
+	{ "timeofday", rpn_do_timeofday, 0, 1, RPNFN_WALLTIME, },
+	{ "dayofweek", rpn_do_dayofweek, 0, 1, RPNFN_WALLTIME, },
+	{ "abstime", rpn_do_abstime, 0, 1, RPNFN_WALLTIME, },
+	{ "uptime", rpn_do_uptime, 0, 1, },
+	{ "strftime", rpn_do_strftime, 2, 1, },
+	{ "delaytostr", rpn_do_delaytostr, 1, 1, RPNFN_PURE, },
+
+	{ "printf", rpn_do_fmtvalue, 2, 1, RPNFN_PURE, },
+
+	{ "degtorad", rpn_do_degtorad, 1, 1, RPNFN_PURE, },
+	{ "radtodeg", rpn_do_radtodeg, 1, 1, RPNFN_PURE, },
+	{ "sin", rpn_do_sin, 1, 1, RPNFN_PURE, },
+	{ "cos", rpn_do_cos, 1, 1, RPNFN_PURE, },
+
+	{ "sun", rpn_do_sun, 2, 1, RPNFN_WALLTIME, },
+	{ "sun3", rpn_do_sun3, 3, 1, RPNFN_PURE, },
+	{ "sunabove", rpn_do_sunabove, 3, 1, RPNFN_PERIODIC | RPNFN_WALLTIME, sizeof(struct sunabove), }, /* lat lon elv sunabove */
+	{ "azimuth3", rpn_do_azimuth3, 3, 1, RPNFN_PURE, },
+	{ "celestial_angle", rpn_do_celestial_angle, 4, 1, RPNFN_PURE, }, /* azm1 elv1 azm2 elv2 celestial_angle */
+
+	{ "if", rpn_do_if, 1, 0, },
+	{ "else", rpn_do_else, 0, 0, },
+	{ "fi", rpn_do_fi, 0, 0, },
+	{ "quit", rpn_do_quit, 0, 0, },
+	{ "", },
+};
+
+/* profiler
+ * Counts executions & ticks per lookup entry, for the whole process.
+ * Topic reads, writes & aggregates have their own entry.
+ */
+struct rpn_prof {
+	const char *name;
+	unsigned long count;
+	unsigned long long ticks;
+};
+
+enum {
+	PROF_ENV,
+	PROF_WRITEENV,
+	PROF_AGGR,
+	NPROF_EXTRA,
+};
+
+static int rpn_profiling;
+static struct rpn_prof extra_profs[NPROF_EXTRA] = {
+	[PROF_ENV] = { "${}", },
+	[PROF_WRITEENV] = { ">{}", },
+	[PROF_AGGR] = { "aggregate", },
+};
+
+/* registered tables of lookups, with 1 profiler entry per lookup.
+ * Entries never move, compiled programs point to them.
+ */
+static struct lookup_table {
+	struct lookup_table *next;
+	const struct lookup *lookups;
+	int n;
+	struct rpn_prof profs[];
+} *lookup_tables;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PROF_UNIT "cycles"
+static inline unsigned long long rpn_ticks(void)
+{
+	return __builtin_ia32_rdtsc();
+}
+#else
+#define PROF_UNIT "ns"
+static inline unsigned long long rpn_ticks(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static struct rpn_prof *rpn_prof_of(const struct rpn *rpn)
+{
+	struct lookup_table *table;
+
+	if (rpn->lookup) {
+		for (table = lookup_tables; table; table = table->next) {
+			if (rpn->lookup >= table->lookups && rpn->lookup < table->lookups + table->n)
+				return table->profs + (rpn->lookup - table->lookups);
+		}
+	} else if (rpn->run == rpn_do_env)
+		return extra_profs + PROF_ENV;
+	else if (rpn->run == rpn_do_writeenv)
+		return extra_profs + PROF_WRITEENV;
+	else if (rpn->run == rpn_do_aggr)
+		return extra_profs + PROF_AGGR;
+	return NULL;
+}
+
+/* call @fn for all profiler entries */
+static void rpn_prof_foreach(void (*fn)(struct rpn_prof *, void *), void *dat)
+{
+	struct lookup_table *table;
+	int j;
+
+	for (table = lookup_tables; table; table = table->next) {
+		for (j = 0; j < table->n; ++j)
+			fn(table->profs+j, dat);
+	}
+	for (j = 0; j < NPROF_EXTRA; ++j)
+		fn(extra_profs+j, dat);
+}
+
+void rpn_profile_enable(int enable)
+{
+	rpn_profiling = enable;
+}
+
+static void rpn_prof_reset(struct rpn_prof *prof, void *dat)
+{
+	prof->count = prof->ticks = 0;
+}
+
+void rpn_profile_reset(void)
+{
+	rpn_prof_foreach(rpn_prof_reset, NULL);
+}
+
+static int profcmp(const void *a, const void *b)
+{
+	const struct rpn_prof *pa = *(const struct rpn_prof **)a;
+	const struct rpn_prof *pb = *(const struct rpn_prof **)b;
+
+	return (pa->ticks < pb->ticks) - (pa->ticks > pb->ticks);
+}
+
+struct profdump {
+	struct rpn_prof **sorted;
+	int n, s;
+	unsigned long long total;
+};
+
+static void rpn_prof_collect(struct rpn_prof *prof, void *dat)
+{
+	struct profdump *dump = dat;
+
+	if (!prof->count)
+		return;
+	if (dump->n >= dump->s) {
+		dump->s = dump->s*2 ?: 64;
+		dump->sorted = realloc(dump->sorted, sizeof(*dump->sorted)*dump->s);
+		if (!dump->sorted)
+			mylog(LOG_ERR, "realloc profiler dump %i", dump->s);
+	}
+	dump->sorted[dump->n++] = prof;
+	dump->total += prof->ticks;
+}
+
+void rpn_profile_dump(FILE *fp)
+{
+	struct profdump dump = {};
+	struct rpn_prof **sorted;
+	unsigned long long total;
+	int j, n;
+
+	rpn_prof_foreach(rpn_prof_collect, &dump);
+	sorted = dump.sorted;
+	n = dump.n;
+	total = dump.total;
+	if (n)
+		qsort(sorted, n, sizeof(*sorted), profcmp);
+	fprintf(fp, "%-16s %12s %16s %12s %6s\n", "operator", "count",
+			PROF_UNIT, PROF_UNIT "/op", "%");
+	for (j = 0; j < n; ++j)
+		fprintf(fp, "%-16s %12lu %16llu %12.1f %6.2f\n", sorted[j]->name,
+				sorted[j]->count, sorted[j]->ticks,
+				(double)sorted[j]->ticks / sorted[j]->count,
+				total ? 100.0 * sorted[j]->ticks / total : 0);
+	free(sorted);
+}
+
+static const char *rpn_name(const struct rpn *rpn)
+{
+	if (rpn->lookup)
+		return rpn->lookup->str;
+	else if (rpn->topic)
+		return rpn->topic;
+	else if (rpn->constvalue)
+		return rpn->constvalue;
+	return mydtostr(rpn->value);
+}
+
+static void rpn_merge_depth(int (*range)[2], int lo, int hi)
+{
+	if (lo < (*range)[0])
+		(*range)[0] = lo;
+	if (hi > (*range)[1])
+		(*range)[1] = hi;
+}
+
+/* static stack analysis
+ * Jumps only go forward, so 1 pass propagates the depth range
+ * of each instruction to its successors.
+ * Operators that may underflow are turned into checked variants,
+ * all others run without checks.
+ */
+static void rpn_verify_stack(struct rpn_prog *prog)
+{
+	int (*range)[2];
+	struct rpn_insn *insn;
+	int j, lo, hi;
+
+	range = malloc(sizeof(*range)*(prog->ninsn+1));
+	if (!range)
+		mylog(LOG_ERR, "malloc stack analysis %i", prog->ninsn);
+	for (j = 0; j <= prog->ninsn; ++j) {
+		range[j][0] = INT_MAX;
+		range[j][1] = -1;
+	}
+	range[0][0] = range[0][1] = 0;
+	prog->maxdepth = 0;
+
+	for (j = 0, insn = prog->insn; j < prog->ninsn; ++j, ++insn) {
+		if (range[j][1] < 0)
+			/* not reachable */
+			continue;
+		if (range[j][0] < insn->pops) {
+			mylog(LOG_INFO | LOG_MQTT, "stack underflow possible at '%s'", rpn_name(insn->me));
+			insn->op = (insn->op == OP_IF) ? OP_IFCHK : OP_CALLCHK;
+		}
+		/* paths that underflow stop here */
+		lo = ((range[j][0] > insn->pops) ? range[j][0] : insn->pops)
+			- insn->pops + insn->pushes;
+		hi = ((range[j][1] > insn->pops) ? range[j][1] : insn->pops)
+			- insn->pops + insn->pushes + insn->xpushes;
+		if (hi > prog->maxdepth)
+			prog->maxdepth = hi;
+		if (insn->op != OP_JUMP)
+			rpn_merge_depth(range+j+1, lo, hi);
+		if (insn->op == OP_JUMP || insn->op == OP_IF || insn->op == OP_IFCHK)
+			rpn_merge_depth(range+insn->jump, lo, hi);
+		else if (insn->op == OP_SEG)
+			/* the cached result is pushed */
+			rpn_merge_depth(range+insn->jump, lo+1, hi+1);
+	}
+	free(range);
+}
+
+static inline int is_wildcard(const char *topic)
+{
+	return topic && strpbrk(topic, "+#");
+}
+
+/* optimizer
+ * This only changes the program, the rpn chain remains intact.
+ */
+static const char *rpn_prog_strdup(struct rpn_prog *prog, const char *str)
+{
+	if (!str)
+		return NULL;
+	if (!(prog->nstrs % 16)) {
+		prog->strs = realloc(prog->strs, sizeof(*prog->strs)*(prog->nstrs+16));
+		if (!prog->strs)
+			mylog(LOG_ERR, "realloc strings %i", prog->nstrs+16);
+	}
+	prog->strs[prog->nstrs] = strdup(str);
+	return prog->strs[prog->nstrs++];
+}
+
+static void rpn_remap_jumps(struct rpn_prog *prog, const int *map)
+{
+	int j;
+
+	for (j = 0; j < prog->ninsn; ++j) {
+		if (prog->insn[j].op == OP_IF || prog->insn[j].op == OP_JUMP)
+			prog->insn[j].jump = map[prog->insn[j].jump];
+	}
+}
+
+/* fold pure operators with constant operands,
+ * and conditions on constants
+ */
+static int rpn_fold(struct rpn_prog *prog)
+{
+	struct stack tmp = {};
+	struct rpn_insn *out, *first, in;
+	char *targets;
+	int *map;
+	int j, k, nconst, changed = 0;
+
+	targets = malloc(prog->ninsn+1);
+	map = malloc(sizeof(*map)*(prog->ninsn+1));
+	if (!targets || !map)
+		mylog(LOG_ERR, "malloc fold %i", prog->ninsn);
+	memset(targets, 0, prog->ninsn+1);
+	for (j = 0; j < prog->ninsn; ++j) {
+		if (prog->insn[j].op == OP_IF || prog->insn[j].op == OP_JUMP)
+			targets[prog->insn[j].jump] = 1;
+	}
+
+	for (j = nconst = 0, out = prog->insn; j <= prog->ninsn; ++j) {
+		/* results may overwrite the current insn */
+		in = prog->insn[j];
+		map[j] = out - prog->insn;
+		if (targets[j])
+			/* other paths join here */
+			nconst = 0;
+
+		if (in.op == OP_CALL && (in.me->flags & RPNFN_PURE) &&
+				nconst >= in.pops && in.pushes <= in.pops+1) {
+			first = out - in.pops;
+			rpn_stack_reset(&tmp);
+			rpn_reserve(&tmp, in.pops + in.pushes);
+			for (k = 0; k < in.pops; ++k)
+				rpn_push_str(&tmp, first[k].str, first[k].value);
+			in.run(&tmp, in.me);
+			if (!tmp.errnum && tmp.n == in.pushes) {
+				for (k = 0; k < tmp.n; ++k) {
+					memset(first+k, 0, sizeof(*first));
+					first[k].op = OP_CONST;
+					first[k].pushes = 1;
+					first[k].value = tmp.v[k].d;
+					first[k].str = rpn_prog_strdup(prog, tmp.v[k].a);
+					first[k].me = in.me;
+				}
+				out = first + tmp.n;
+				nconst += tmp.n - in.pops;
+				changed = 1;
+				continue;
+			}
+		} else if (in.op == OP_IF && nconst) {
+			/* condition is known */
+			--out;
+			--nconst;
+			if (!rpn_toint(out->value)) {
+				*out = in;
+				out->op = OP_JUMP;
+				out->pops = 0;
+				++out;
+				nconst = 0;
+			}
+			changed = 1;
+			continue;
+		}
+		*out++ = in;
+		nconst = (in.op == OP_CONST) ? nconst+1 : 0;
+	}
+	prog->ninsn = out - prog->insn - 1;
+	rpn_remap_jumps(prog, map);
+	rpn_stack_free(&tmp);
+	free(targets);
+	free(map);
+	return changed;
+}
+
+/* remove unreachable code & jumps to the next insn */
+static int rpn_prune(struct rpn_prog *prog)
+{
+	char *reach;
+	int *map;
+	int j, k, n, changed = 0;
+
+	reach = malloc(prog->ninsn+1);
+	map = malloc(sizeof(*map)*(prog->ninsn+1));
+	if (!reach || !map)
+		mylog(LOG_ERR, "malloc prune %i", prog->ninsn);
+	memset(reach, 0, prog->ninsn+1);
+	reach[0] = reach[prog->ninsn] = 1;
+	/* jumps go forward */
+	for (j = 0; j < prog->ninsn; ++j) {
+		if (!reach[j])
+			continue;
+		if (prog->insn[j].op != OP_JUMP)
+			reach[j+1] = 1;
+		if (prog->insn[j].op == OP_IF || prog->insn[j].op == OP_JUMP)
+			reach[prog->insn[j].jump] = 1;
+	}
+
+	for (j = n = 0; j <= prog->ninsn; ++j) {
+		map[j] = n;
+		if (!reach[j]) {
+			changed = 1;
+			continue;
+		}
+		if (prog->insn[j].op == OP_JUMP) {
+			for (k = j+1; k < prog->insn[j].jump && !reach[k]; ++k);
+			if (k == prog->insn[j].jump) {
+				changed = 1;
+				continue;
+			}
+		}
+		prog->insn[n++] = prog->insn[j];
+	}
+	prog->ninsn = n-1;
+	rpn_remap_jumps(prog, map);
+	free(reach);
+	free(map);
+	return changed;
+}
+
+/* pure segments
+ * A pure subexpression that reads topics is wrapped in
+ * OP_SEG & OP_SEGEND. Its numeric result is reused until
+ * rpn_env_changed() invalidates one of its topics.
+ */
+struct segrange {
+	int start, end; /* first & last insn */
+	int ntopics;
+	int parent;
+	int keep;
+	int seg; /* index in prog->segs */
+	int pos; /* of OP_SEG in the new program */
+};
+
+static int rpn_is_topic_ref(const struct rpn_insn *insn)
+{
+	return insn->op == OP_CALL && insn->run == rpn_do_env &&
+		!is_wildcard(insn->me->topic);
+}
+
+/* count the distinct topics in @r */
+static int rpn_seg_topics(const struct rpn_prog *prog, const struct segrange *r)
+{
+	int j, k, n = 0;
+
+	for (j = r->start; j <= r->end; ++j) {
+		if (!rpn_is_topic_ref(prog->insn+j))
+			continue;
+		for (k = r->start; k < j; ++k) {
+			if (rpn_is_topic_ref(prog->insn+k) &&
+					!strcmp(prog->insn[k].me->topic, prog->insn[j].me->topic))
+				break;
+		}
+		if (k >= j)
+			++n;
+	}
+	return n;
+}
+
+static struct rpn_prog *rpn_segment(struct rpn_prog *prog)
+{
+	struct { int start, pure; } *sim;
+	struct segrange *ranges;
+	struct rpn_prog *newprog;
+	struct rpn_insn *insn, *out;
+	struct rpn_seg *seg;
+	char *targets;
+	int *map;
+	int j, k, nsim, nranges, start, pure, nnew, nsegs;
+
+	for (j = 0; j < prog->ninsn; ++j) {
+		/* these depend on which topic was read last */
+		if (prog->insn[j].run == rpn_do_isnew || prog->insn[j].run == rpn_do_timeout)
+			return prog;
+	}
+	sim = malloc(sizeof(*sim)*(prog->ninsn+1));
+	ranges = malloc(sizeof(*ranges)*(prog->ninsn+1));
+	targets = malloc(prog->ninsn+1);
+	if (!sim || !ranges || !targets)
+		mylog(LOG_ERR, "malloc segments %i", prog->ninsn);
+	memset(targets, 0, prog->ninsn+1);
+	for (j = 0; j < prog->ninsn; ++j) {
+		if (prog->insn[j].op == OP_IF || prog->insn[j].op == OP_JUMP)
+			targets[prog->insn[j].jump] = 1;
+	}
+
+	/* find pure subtrees within each basic block */
+	for (j = nsim = nranges = 0; j < prog->ninsn; ++j) {
+		insn = prog->insn+j;
+		if (targets[j])
+			nsim = 0;
+		if (insn->op == OP_CONST || rpn_is_topic_ref(insn)) {
+			sim[nsim].start = j;
+			sim[nsim++].pure = 1;
+			continue;
+		}
+		if (insn->op != OP_CALL || nsim < insn->pops) {
+			/* operands from outside this block */
+			nsim = 0;
+			continue;
+		}
+		start = j;
+		pure = (insn->me->flags & RPNFN_PURE) && insn->pushes == 1 && !insn->xpushes;
+		for (k = 0; k < insn->pops; ++k) {
+			--nsim;
+			start = sim[nsim].start;
+			pure = pure && sim[nsim].pure;
+		}
+		if (pure && j - start >= 2) {
+			ranges[nranges].start = start;
+			ranges[nranges].end = j;
+			ranges[nranges].ntopics = rpn_seg_topics(prog, ranges+nranges);
+			ranges[nranges++].parent = -1;
+		}
+		for (k = 0; k < insn->pushes; ++k) {
+			sim[nsim].start = pure ? start : j;
+			sim[nsim++].pure = pure;
+		}
+	}
+
+	/* keep the outermost segments, and inner ones that depend on fewer topics */
+	for (j = nsegs = 0; j < nranges; ++j) {
+		for (k = j+1; k < nranges; ++k) {
+			if (ranges[k].start <= ranges[j].start && ranges[k].end >= ranges[j].end) {
+				ranges[j].parent = k;
+				break;
+			}
+		}
+	}
+	for (j = 0; j < nranges; ++j) {
+		k = ranges[j].parent;
+		ranges[j].keep = ranges[j].ntopics &&
+			(k < 0 || ranges[j].ntopics < ranges[k].ntopics);
+		nsegs += ranges[j].keep;
+	}
+	free(sim);
+	free(targets);
+	if (!nsegs) {
+		free(ranges);
+		return prog;
+	}
+
+	/* emit with markers */
+	nnew = prog->ninsn + 2*nsegs;
+	newprog = malloc(sizeof(*newprog) + sizeof(newprog->insn[0])*(nnew+1));
+	map = malloc(sizeof(*map)*(prog->ninsn+1));
+	if (!newprog || !map)
+		mylog(LOG_ERR, "malloc segments %i", nnew);
+	*newprog = *prog;
+	newprog->segs = malloc(sizeof(*newprog->segs)*nsegs);
+	if (!newprog->segs)
+		mylog(LOG_ERR, "malloc segments %i", nsegs);
+	memset(newprog->segs, 0, sizeof(*newprog->segs)*nsegs);
+	newprog->nsegs = nsegs;
+	for (j = nsegs = 0; j < nranges; ++j) {
+		if (!ranges[j].keep)
+			continue;
+		ranges[j].seg = nsegs;
+		seg = newprog->segs + nsegs++;
+		seg->deps = malloc(sizeof(*seg->deps)*(ranges[j].end - ranges[j].start));
+		if (!seg->deps)
+			mylog(LOG_ERR, "malloc segment deps");
+		for (k = ranges[j].start; k <= ranges[j].end; ++k) {
+			if (rpn_is_topic_ref(prog->insn+k))
+				seg->deps[seg->ndeps++] = prog->insn[k].me;
+		}
+	}
+
+	out = newprog->insn;
+	for (j = 0; j <= prog->ninsn; ++j) {
+		map[j] = out - newprog->insn;
+		/* outer segments first, these come later in ranges */
+		for (k = nranges-1; k >= 0; --k) {
+			if (!ranges[k].keep || ranges[k].start != j)
+				continue;
+			memset(out, 0, sizeof(*out));
+			out->op = OP_SEG;
+			out->seg = ranges[k].seg;
+			ranges[k].pos = out - newprog->insn;
+			++out;
+		}
+		*out++ = prog->insn[j];
+		/* inner segments first */
+		for (k = 0; k < nranges; ++k) {
+			if (!ranges[k].keep || ranges[k].end != j)
+				continue;
+			memset(out, 0, sizeof(*out));
+			out->op = OP_SEGEND;
+			out->seg = ranges[k].seg;
+			++out;
+			newprog->insn[ranges[k].pos].jump = out - newprog->insn;
+		}
+	}
+	for (j = 0, insn = newprog->insn; j < nnew; ++j, ++insn) {
+		if (insn->op == OP_IF || insn->op == OP_JUMP)
+			insn->jump = map[insn->jump];
+	}
+	newprog->ninsn = nnew;
+	free(ranges);
+	free(map);
+	free(prog);
+	return newprog;
+}
+
+/* a topic changed value, NULL for all */
+void rpn_env_changed(struct rpn *root, const char *topic)
+{
+	struct rpn_seg *seg;
+	int j, k;
+
+	if (!root || !root->prog)
+		return;
+	for (j = 0, seg = root->prog->segs; j < root->prog->nsegs; ++j, ++seg) {
+		for (k = 0; seg->valid && k < seg->ndeps; ++k) {
+			if (!topic || !strcmp(seg->deps[k]->topic, topic))
+				seg->valid = 0;
+		}
+	}
+}
+
+/* native programs */
+static void rpn_compile(struct rpn *root);
+
+static const struct rpn_native **natives;
+static int nnatives;
+
+void rpn_add_natives(const struct rpn_native *table)
+{
+	natives = realloc(natives, sizeof(*natives)*(nnatives+1));
+	if (!natives)
+		mylog(LOG_ERR, "realloc natives %i", nnatives+1);
+	natives[nnatives++] = table;
+}
+
+/* the signature covers all that the generated code depends on */
+static char *rpn_prog_signature(const struct rpn_prog *prog)
+{
+	const struct rpn_insn *insn;
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *fp;
+	int j;
+
+	fp = open_memstream(&buf, &size);
+	if (!fp)
+		mylog(LOG_ERR, "open_memstream: %s", ESTR(errno));
+	for (j = 0, insn = prog->insn; j < prog->ninsn; ++j, ++insn) {
+		if (j)
+			fputc(' ', fp);
+		switch (insn->op) {
+		case OP_CONST:
+			fprintf(fp, "%a", insn->value);
+			if (insn->str)
+				fprintf(fp, "\"%s\"", insn->str);
+			break;
+		case OP_CALL:
+		case OP_CALLCHK:
+			fprintf(fp, "%s/%i/%i/%i", rpn_name(insn->me),
+					insn->pops, insn->pushes, insn->xpushes);
+			break;
+		case OP_IF:
+		case OP_IFCHK:
+			fprintf(fp, "if>%i", insn->jump);
+			break;
+		case OP_JUMP:
+			fprintf(fp, "jmp>%i", insn->jump);
+			break;
+		case OP_SEG:
+			fprintf(fp, "seg%i>%i", insn->seg, insn->jump);
+			break;
+		case OP_SEGEND:
+			fprintf(fp, "end%i", insn->seg);
+			break;
+		}
+	}
+	fclose(fp);
+	return buf;
+}
+
+static void rpn_attach_native(struct rpn_prog *prog)
+{
+	const struct rpn_native *native;
+	char *sig;
+	int j;
+
+	sig = rpn_prog_signature(prog);
+	for (j = 0; j < nnatives; ++j) {
+		for (native = natives[j]; native->sig; ++native) {
+			if (!strcmp(native->sig, sig))
+				goto found;
+		}
+	}
+	free(sig);
+	return;
+found:
+	free(sig);
+	prog->me = malloc(sizeof(*prog->me)*(prog->ninsn+1));
+	if (!prog->me)
+		mylog(LOG_ERR, "malloc native %i", prog->ninsn);
+	for (j = 0; j <= prog->ninsn; ++j)
+		prog->me[j] = prog->insn[j].me;
+	prog->native = native->run;
+}
+
+/* C generation
+ * The stack becomes locals dN (value) & aN (string). Locals are
+ * always up to date, the stack in memory is only written
+ * for the operands of a called operator.
+ */
+static const struct {
+	void (*run)(struct stack *st, struct rpn *me);
+	/* %1$i .. %3$i are the slots of the operands */
+	const char *code;
+} native_ops[] = {
+	{ rpn_do_plus, "d[%1$i] += d[%2$i]; a[%1$i] = NULL;", },
+	{ rpn_do_minus, "d[%1$i] -= d[%2$i]; a[%1$i] = NULL;", },
+	{ rpn_do_mul, "d[%1$i] *= d[%2$i]; a[%1$i] = NULL;", },
+	{ rpn_do_div, "d[%1$i] /= d[%2$i]; a[%1$i] = NULL;", },
+	{ rpn_do_mod, "d[%1$i] = fmod(d[%1$i], d[%2$i]); a[%1$i] = NULL;", },
+	{ rpn_do_pow, "d[%1$i] = pow(d[%1$i], d[%2$i]); a[%1$i] = NULL;", },
+	{ rpn_do_negative, "d[%1$i] = -d[%1$i]; a[%1$i] = NULL;", },
+	{ rpn_do_bitand, "d[%1$i] = rpn_toint(d[%1$i]) & rpn_toint(d[%2$i]); a[%1$i] = NULL;", },
+	{ rpn_do_bitor, "d[%1$i] = rpn_toint(d[%1$i]) | rpn_toint(d[%2$i]); a[%1$i] = NULL;", },
+	{ rpn_do_bitxor, "d[%1$i] = rpn_toint(d[%1$i]) ^ rpn_toint(d[%2$i]); a[%1$i] = NULL;", },
+	{ rpn_do_bitinv, "d[%1$i] = ~rpn_toint(d[%1$i]); a[%1$i] = NULL;", },
+	{ rpn_do_booland, "d[%1$i] = rpn_toint(d[%1$i]) && rpn_toint(d[%2$i]); a[%1$i] = NULL;", },
+	{ rpn_do_boolor, "d[%1$i] = rpn_toint(d[%1$i]) || rpn_toint(d[%2$i]); a[%1$i] = NULL;", },
+	{ rpn_do_boolnot, "d[%1$i] = !rpn_toint(d[%1$i]); a[%1$i] = NULL;", },
+	{ rpn_do_intequal, "d[%1$i] = (a[%1$i] && a[%2$i]) ? !strcasecmp(a[%1$i], a[%2$i]) : "
+		"rpn_toint(d[%1$i]) == rpn_toint(d[%2$i]); a[%1$i] = NULL;", },
+	{ rpn_do_intnotequal, "d[%1$i] = (a[%1$i] && a[%2$i]) ? !!strcasecmp(a[%1$i], a[%2$i]) : "
+		"rpn_toint(d[%1$i]) != rpn_toint(d[%2$i]); a[%1$i] = NULL;", },
+	{ rpn_do_lt, "d[%1$i] = d[%1$i] < d[%2$i]; a[%1$i] = NULL;", },
+	{ rpn_do_gt, "d[%1$i] = d[%1$i] > d[%2$i]; a[%1$i] = NULL;", },
+	{ rpn_do_dup, "d[%2$i] = d[%1$i]; a[%2$i] = a[%1$i];", },
+	{ rpn_do_pop, "", },
+	{ rpn_do_swap, "{ double td = d[%1$i]; const char *ta = a[%1$i]; "
+		"d[%1$i] = d[%2$i]; a[%1$i] = a[%2$i]; d[%2$i] = td; a[%2$i] = ta; }", },
+	{ rpn_do_ifthenelse, "if (rpn_toint(d[%1$i])) { d[%1$i] = d[%2$i]; a[%1$i] = a[%2$i]; } "
+		"else { d[%1$i] = d[%3$i]; a[%1$i] = a[%3$i]; }", },
+};
+
+static const char *native_op(const struct rpn_insn *insn)
+{
+	int j;
+
+	for (j = 0; j < sizeof(native_ops)/sizeof(native_ops[0]); ++j) {
+		if (native_ops[j].run == insn->run)
+			return native_ops[j].code;
+	}
+	return NULL;
+}
+
+static void emit_double(FILE *fp, double value)
+{
+	if (isnan(value))
+		fputs("NAN", fp);
+	else if (isinf(value))
+		fputs((value < 0) ? "-INFINITY" : "INFINITY", fp);
+	else
+		fprintf(fp, "%a", value);
+}
+
+static void emit_string(FILE *fp, const char *str)
+{
+	if (!str) {
+		fputs("NULL", fp);
+		return;
+	}
+	fputc('"', fp);
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if (*str >= ' ' && *str < 0x7f)
+			fputc(*str, fp);
+		else
+			fprintf(fp, "\\%03o", *str & 0xff);
+	}
+	fputc('"', fp);
+}
+
+/* write back the dirty slots [from, to) */
+static void emit_spill(FILE *fp, char *dirty, int from, int to)
+{
+	for (; from < to; ++from) {
+		if (!dirty[from])
+			continue;
+		fprintf(fp, "\tv[%i].d = d[%i]; v[%i].a = a[%i];\n", from, from, from, from);
+		dirty[from] = 0;
+	}
+}
+
+/* set the depth of insn @j, fail when paths join with different depths */
+static int native_depth(int *depth, int j, int value)
+{
+	if (depth[j] >= 0 && depth[j] != value)
+		return -1;
+	depth[j] = value;
+	return 0;
+}
+
+int rpn_emit_c(FILE *fp, struct rpn *root, const char *name)
+{
+	struct rpn_prog *prog;
+	const struct rpn_insn *insn;
+	const char *code;
+	int *depth;
+	char *label, *dirty;
+	int j, k, out, ret = -1;
+
+	if (!root)
+		return -1;
+	if (!root->prog)
+		rpn_compile(root);
+	prog = root->prog;
+
+	depth = malloc(sizeof(*depth)*(prog->ninsn+1));
+	label = malloc(prog->ninsn+1);
+	dirty = malloc(prog->maxdepth+1);
+	if (!depth || !label || !dirty)
+		mylog(LOG_ERR, "malloc emit %i", prog->ninsn);
+	memset(depth, 0xff, sizeof(*depth)*(prog->ninsn+1));
+	memset(label, 0, prog->ninsn+1);
+	memset(dirty, 1, prog->maxdepth+1);
+
+	/* the stack depth must be known at each insn */
+	depth[0] = 0;
+	for (j = 0, insn = prog->insn; j < prog->ninsn; ++j, ++insn) {
+		if (depth[j] < 0)
+			continue;
+		if (insn->op == OP_CALLCHK || insn->op == OP_IFCHK || insn->xpushes)
+			goto done;
+		out = depth[j] - insn->pops + insn->pushes;
+		if (insn->op != OP_JUMP && native_depth(depth, j+1, out) < 0)
+			goto done;
+		if (insn->op == OP_IF || insn->op == OP_JUMP || insn->op == OP_SEG) {
+			label[insn->jump] = 1;
+			if (native_depth(depth, insn->jump, out + (insn->op == OP_SEG)) < 0)
+				goto done;
+		}
+	}
+
+	fprintf(fp, "static int %s(struct stack *st, struct rpn *const *me, struct rpn_seg *segs)\n{\n", name);
+	fprintf(fp, "\tint base = st->n;\n");
+	fprintf(fp, "\tstruct rpn_el *v = st->v + base;\n");
+	if (prog->maxdepth)
+		fprintf(fp, "\tdouble d[%i];\n\tconst char *a[%i];\n", prog->maxdepth, prog->maxdepth);
+	fputc('\n', fp);
+
+	for (j = 0, insn = prog->insn; j <= prog->ninsn; ++j, ++insn) {
+		if (depth[j] < 0)
+			continue;
+		k = depth[j];
+		if (label[j]) {
+			fprintf(fp, "L%i:\n", j);
+			/* the paths that join may have written different slots */
+			memset(dirty, 1, prog->maxdepth+1);
+		}
+		switch (insn->op) {
+		case OP_CONST:
+			fprintf(fp, "\td[%i] = ", k);
+			emit_double(fp, insn->value);
+			fprintf(fp, "; a[%i] = ", k);
+			emit_string(fp, insn->str);
+			fputs(";\n", fp);
+			dirty[k] = 1;
+			break;
+		case OP_CALL:
+			code = native_op(insn);
+			if (code) {
+				fputc('\t', fp);
+				fprintf(fp, code, k - insn->pops, k - insn->pops + 1, k - insn->pops + 2);
+				fprintf(fp, " /* %s */\n", rpn_name(insn->me));
+				memset(dirty + k - insn->pops, 1, insn->pushes);
+				break;
+			}
+			emit_spill(fp, dirty, k - insn->pops, k);
+			fprintf(fp, "\tst->n = base + %i;\n", k);
+			fprintf(fp, "\tme[%i]->run(st, me[%i]); /* %s */\n", j, j, rpn_name(insn->me));
+			fprintf(fp, "\tif (st->errnum)\n\t\treturn -st->errnum;\n");
+			fprintf(fp, "\tv = st->v + base;\n");
+			for (out = k - insn->pops; out < k - insn->pops + insn->pushes; ++out) {
+				fprintf(fp, "\td[%i] = v[%i].d; a[%i] = v[%i].a;\n", out, out, out, out);
+				dirty[out] = 0;
+			}
+			break;
+		case OP_IF:
+			fprintf(fp, "\tif (!rpn_toint(d[%i]))\n\t\tgoto L%i;\n", k-1, insn->jump);
+			break;
+		case OP_JUMP:
+			fprintf(fp, "\tgoto L%i;\n", insn->jump);
+			break;
+		case OP_SEG:
+			fprintf(fp, "\tif (segs[%i].valid) {\n", insn->seg);
+			fprintf(fp, "\t\td[%i] = segs[%i].value; a[%i] = NULL;\n", k, insn->seg, k);
+			fprintf(fp, "\t\tgoto L%i;\n\t}\n", insn->jump);
+			break;
+		case OP_SEGEND:
+			fprintf(fp, "\tif (!a[%i]) {\n", k-1);
+			fprintf(fp, "\t\tsegs[%i].value = d[%i];\n", insn->seg, k-1);
+			fprintf(fp, "\t\tsegs[%i].valid = 1;\n\t}\n", insn->seg);
+			break;
+		case OP_END:
+			emit_spill(fp, dirty, 0, k);
+			fprintf(fp, "\tst->n = base + %i;\n\treturn 0;\n", k);
+			break;
+		}
+	}
+	fputs("}\n", fp);
+	ret = 0;
+done:
+	free(depth);
+	free(label);
+	free(dirty);
+	return ret;
+}
+
+char *rpn_native_signature(struct rpn *root)
+{
+	if (!root)
+		return NULL;
+	if (!root->prog)
+		rpn_compile(root);
+	return rpn_prog_signature(root->prog);
+}
+
+/* compile the rpn chain into a flat program */
+static void rpn_compile(struct rpn *root)
+{
+	struct rpn *rpn, *target, **rpns;
+	struct rpn_prog *prog, *oldprog = root->prog;
+	struct rpn_insn *insn;
+	int *idx;
+	int n, j, k, ninsn, privsize;
+	char *privs;
+
+	for (n = 0, rpn = root; rpn; rpn = rpn->next, ++n);
+	rpns = malloc(sizeof(*rpns)*n);
+	idx = malloc(sizeof(*idx)*(n+1));
+	if (!rpns || !idx)
+		mylog(LOG_ERR, "malloc compile %i", n);
+
+	/* assign instruction index, fi is not emitted */
+	for (j = ninsn = privsize = 0, rpn = root; rpn; rpn = rpn->next, ++j) {
+		rpns[j] = rpn;
+		idx[j] = ninsn;
+		if (rpn->run != rpn_do_fi)
+			++ninsn;
+		if (rpn->lookup && rpn->lookup->privsize)
+			privsize += (rpn->lookup->privsize + 15) & ~15;
+	}
+	idx[n] = ninsn;
+
+	prog = malloc(sizeof(*prog) + sizeof(prog->insn[0])*(ninsn+1));
+	if (!prog)
+		mylog(LOG_ERR, "malloc program %i", ninsn);
+	memset(prog, 0, sizeof(*prog) + sizeof(prog->insn[0])*(ninsn+1));
+	prog->ninsn = ninsn;
+
+	/* move private data into 1 side array */
+	privs = prog->privs = privsize ? malloc(privsize) : NULL;
+	for (j = 0; j < n; ++j) {
+		rpn = rpns[j];
+		if (!rpn->priv)
+			continue;
+		memcpy(privs, rpn->priv, rpn->lookup->privsize);
+		if (!rpn->privpacked)
+			free(rpn->priv);
+		rpn->priv = privs;
+		rpn->privpacked = 1;
+		privs += (rpn->lookup->privsize + 15) & ~15;
+	}
+
+	for (j = 0, insn = prog->insn; j < n; ++j) {
+		rpn = rpns[j];
+		if (rpn->run == rpn_do_fi)
+			continue;
+		insn->me = rpn;
+		insn->run = rpn->run;
+		insn->pops = rpn->pops;
+		insn->pushes = rpn->pushes;
+		insn->xpushes = rpn->xpushes;
+		insn->prof = rpn_prof_of(rpn);
+		if (rpn->run == rpn_do_const) {
+			insn->op = OP_CONST;
+			insn->value = rpn->value;
+			insn->str = rpn->constvalue;
+
+		} else if (rpn->run == rpn_do_if || rpn->run == rpn_do_else ||
+				rpn->run == rpn_do_quit) {
+			insn->op = (rpn->run == rpn_do_if) ? OP_IF : OP_JUMP;
+			target = (rpn->run == rpn_do_quit) ? NULL : rpn->rpn;
+			/* jumps go forward */
+			for (k = j+1; k < n && rpns[k] != target; ++k);
+			insn->jump = idx[k];
+
+		} else {
+			insn->op = OP_CALL;
+		}
+		++insn;
+	}
+	insn->op = OP_END;
+	while (rpn_fold(prog) | rpn_prune(prog));
+	prog = rpn_segment(prog);
+	rpn_verify_stack(prog);
+	if (nnatives)
+		rpn_attach_native(prog);
+
+	free(rpns);
+	free(idx);
+	/* privs of oldprog have moved */
+	rpn_free_prog(oldprog);
+	root->prog = prog;
 }
 
 /* run time functions */
 void rpn_stack_reset(struct stack *st)
 {
 	st->n = 0;
-	st->jumpto = NULL;
 	st->errnum = 0;
+	st->chunk = st->chunks;
+	st->used = 0;
+	if (st->json)
+		st->json->json = NULL;
+}
+
+void rpn_stack_free(struct stack *st)
+{
+	struct rpn_strchunk *chunk;
+
+	while (st->chunks) {
+		chunk = st->chunks;
+		st->chunks = chunk->next;
+		free(chunk);
+	}
+	if (st->json) {
+		if (st->json->tok)
+			free(st->json->tok);
+		free(st->json);
+	}
+	if (st->v)
+		free(st->v);
+	memset(st, 0, sizeof(*st));
 }
 
 int rpn_run(struct stack *st, struct rpn *rpn)
 {
-	for (; rpn; rpn = st->jumpto ?: rpn->next) {
-		if (rpn == QUIT)
-			break;
-		st->jumpto = NULL;
-		rpn->run(st, rpn);
-		if (st->errnum)
-			return -st->errnum;
+	static const void *const dispatch_fast[] = {
+		[OP_CALL] = &&do_call,
+		[OP_CONST] = &&do_const,
+		[OP_IF] = &&do_if,
+		[OP_JUMP] = &&do_jump,
+		[OP_END] = &&do_end,
+		[OP_CALLCHK] = &&do_callchk,
+		[OP_IFCHK] = &&do_ifchk,
+		[OP_SEG] = &&do_seg,
+		[OP_SEGEND] = &&do_segend,
+	};
+	/* same, with timed calls */
+	static const void *const dispatch_prof[] = {
+		[OP_CALL] = &&do_call_prof,
+		[OP_CONST] = &&do_const,
+		[OP_IF] = &&do_if,
+		[OP_JUMP] = &&do_jump,
+		[OP_END] = &&do_end,
+		[OP_CALLCHK] = &&do_callchk_prof,
+		[OP_IFCHK] = &&do_ifchk,
+		[OP_SEG] = &&do_seg,
+		[OP_SEGEND] = &&do_segend,
+	};
+	const void *const *dispatch;
+	const struct rpn_insn *insn, *ip;
+	struct rpn_seg *seg;
+	struct rpn_el *el;
+	unsigned long long t;
+
+	if (!rpn)
+		return 0;
+	if (!rpn->prog)
+		rpn_compile(rpn);
+	insn = ip = rpn->prog->insn;
+	rpn_reserve(st, rpn->prog->maxdepth);
+	if (rpn_profiling)
+		/* natives have no per operator profile */
+		dispatch = dispatch_prof;
+	else if (rpn->prog->native)
+		return rpn->prog->native(st, rpn->prog->me, rpn->prog->segs);
+	else
+		dispatch = dispatch_fast;
+
+	goto *dispatch[ip->op];
+do_callchk:
+	if (st->n < ip->pops)
+		goto underflow;
+do_call:
+	ip->run(st, ip->me);
+	if (st->errnum)
+		return -st->errnum;
+	++ip;
+	goto *dispatch[ip->op];
+do_callchk_prof:
+	if (st->n < ip->pops)
+		goto underflow;
+do_call_prof:
+	t = rpn_ticks();
+	ip->run(st, ip->me);
+	if (ip->prof) {
+		ip->prof->ticks += rpn_ticks() - t;
+		++ip->prof->count;
+	}
+	if (st->errnum)
+		return -st->errnum;
+	++ip;
+	goto *dispatch[ip->op];
+do_const:
+	rpn_push_str(st, ip->str, ip->value);
+	++ip;
+	goto *dispatch[ip->op];
+do_ifchk:
+	if (st->n < 1)
+		goto underflow;
+do_if:
+	if (rpn_toint(rpn_pop1(st)->d))
+		++ip;
+	else
+		ip = insn + ip->jump;
+	goto *dispatch[ip->op];
+do_jump:
+	ip = insn + ip->jump;
+	goto *dispatch[ip->op];
+do_seg:
+	seg = rpn->prog->segs + ip->seg;
+	if (seg->valid) {
+		rpn_push(st, seg->value);
+		ip = insn + ip->jump;
+	} else
+		++ip;
+	goto *dispatch[ip->op];
+do_segend:
+	seg = rpn->prog->segs + ip->seg;
+	el = rpn_n(st, -1);
+	/* strings live in the stack's arena, only cache numbers */
+	if (!el->a) {
+		seg->value = el->d;
+		seg->valid = 1;
 	}
+	++ip;
+	goto *dispatch[ip->op];
+do_end:
 	return 0;
+underflow:
+	st->n = 0;
+	st->errnum = ECANCELED;
+	return -st->errnum;
 }
 
-/* parser */
-static struct lookup {
-	const char *str;
-	void (*run)(struct stack *, struct rpn *);
-	int flags;
-	int privsize;
-	void (*free)(struct rpn *);
-	void (*parse)(struct rpn *, char *str);
-} const lookups[] = {
-	{ "+", rpn_do_plus, },
-	{ "-", rpn_do_minus, },
-	{ "*", rpn_do_mul, },
-	{ "/", rpn_do_div, },
-	{ "%", rpn_do_mod, },
-	{ "**", rpn_do_pow, },
-	{ "neg", rpn_do_negative, },
-
-	{ "&", rpn_do_bitand, },
-	{ "|", rpn_do_bitor, },
-	{ "^", rpn_do_bitxor, },
-	{ "~", rpn_do_bitinv, },
-
-	{ "&&", rpn_do_booland, },
-	{ "||", rpn_do_boolor, },
-	{ "!", rpn_do_boolnot, },
-	{ "not", rpn_do_boolnot, },
-	{ "==", rpn_do_intequal, },
-	{ "!=", rpn_do_intnotequal, },
-
-	{ "<", rpn_do_lt, },
-	{ ">", rpn_do_gt, },
-
-	{ "dup", rpn_do_dup, },
-	{ "pop", rpn_do_pop, },
-	{ "swap", rpn_do_swap, },
-	{ "json", rpn_do_json, },
-	{ "?:", rpn_do_ifthenelse, },
-
-	{ "min", rpn_do_min, },
-	{ "max", rpn_do_max, },
-	{ "limit", rpn_do_limit, },
-	{ "inrange", rpn_do_inrange, },
-	{ "category", rpn_do_category, },
-	{ "hyst1", rpn_do_hyst1, },
-	{ "hyst2", rpn_do_hyst2, },
-	{ "hyst", rpn_do_hyst2, },
-	{ "throttle", rpn_do_debounce2, },
-	{ "avgtime", rpn_do_avgtime, RPNFN_PERIODIC | RPNFN_WALLTIME, sizeof(struct avgtime), },
-	{ "ravg", rpn_do_running_avg, 0, sizeof(struct running),
-		.free = free_running, },
-	{ "rmin", rpn_do_running_min, 0, sizeof(struct running),
-		.free = free_running, },
-	{ "rmax", rpn_do_running_max, 0, sizeof(struct running),
-		.free = free_running, },
-	{ "ramp3", rpn_do_ramp3, },
-	{ "slope", rpn_do_slope, 0, sizeof(struct slope),
-		.free = free_slope, .parse = parse_slope, },
+/* sorted index of lookups, for bsearch */
+static const struct lookup **lookup_index;
+static int nlookup_index;
 
-	{ "ondelay", rpn_do_ondelay, },
-	{ "offdelay", rpn_do_offdelay, },
-	{ "afterdelay", rpn_do_afterdelay, },
-	{ "debounce", rpn_do_debounce, },
-	{ "debounce2", rpn_do_debounce2, },
-	{ "autoreset", rpn_do_autoreset, },
-
-	{ "isnew", rpn_do_isnew, },
-	{ "timeout", rpn_do_timeout, },
-	{ "edge", rpn_do_edge, },
-	{ "rising", rpn_do_rising, },
-	{ "falling", rpn_do_falling, },
-	{ "changed", rpn_do_edge, },
-	{ "pushed", rpn_do_rising, },
-	{ "setreset", rpn_do_setreset, },
-
-	{ "wakeup", rpn_do_wakeup, RPNFN_PERIODIC | RPNFN_WALLTIME, },
-	{ "wakeup2", rpn_do_wakeup2, RPNFN_PERIODIC | RPNFN_WALLTIME, },
-	{ "delta", rpn_do_delta, RPNFN_PERIODIC | RPNFN_WALLTIME, },
-	{ "delta2", rpn_do_delta2, RPNFN_PERIODIC, },
-	{ "timeofday", rpn_do_timeofday, RPNFN_WALLTIME, },
-	{ "dayofweek", rpn_do_dayofweek, RPNFN_WALLTIME, },
-	{ "abstime", rpn_do_abstime, RPNFN_WALLTIME, },
-	{ "uptime", rpn_do_uptime, },
-	{ "strftime", rpn_do_strftime, },
-	{ "delaytostr", rpn_do_delaytostr, },
-
-	{ "printf", rpn_do_fmtvalue, },
-
-	{ "degtorad", rpn_do_degtorad, },
-	{ "radtodeg", rpn_do_radtodeg, },
-	{ "sin", rpn_do_sin, },
-	{ "cos", rpn_do_cos, },
-
-	{ "sun", rpn_do_sun, RPNFN_WALLTIME, },
-	{ "sun3", rpn_do_sun3, },
-	{ "azimuth3", rpn_do_azimuth3, },
-	{ "celestial_angle", rpn_do_celestial_angle, }, /* azm1 elv1 azm2 elv2 celestial_angle */
-
-	{ "if", rpn_do_if, },
-	{ "else", rpn_do_else, },
-	{ "fi", rpn_do_fi, },
-	{ "quit", rpn_do_quit, },
-	{ "", },
+static int lookupcmp(const void *a, const void *b)
+{
+	return strcmp((*(const struct lookup **)a)->str, (*(const struct lookup **)b)->str);
+}
+
+/* parser tokens are views into the input */
+struct rpn_tok {
+	const char *str;
+	int len;
 };
 
-static const struct lookup *do_lookup(const char *tok, char **pendp)
+/* compare a token with a null terminated name */
+static int tokcmp(const struct rpn_tok *tok, const char *name)
 {
-	const struct lookup *lookup;
-	char *endp;
+	int ret = strncmp(tok->str, name, tok->len);
+
+	if (ret)
+		return ret;
+	return name[tok->len] ? -1 : 0;
+}
+
+static int lookupkeycmp(const void *key, const void *b)
+{
+	return tokcmp(key, (*(const struct lookup **)b)->str);
+}
+
+static const struct lookup *lookup_find(const struct rpn_tok *name)
+{
+	const struct lookup **lookup;
 
-	if (!pendp)
-		pendp = &endp;
+	if (!nlookup_index)
+		return NULL;
+	lookup = bsearch(name, lookup_index, nlookup_index, sizeof(*lookup_index), lookupkeycmp);
+	return lookup ? *lookup : NULL;
+}
 
-	*pendp = strchr(tok, ',');
-	if (*pendp) {
-		**pendp = 0;
-		(*pendp)++;
+/* add @lookups to the index, without version check */
+static int lookup_register(const struct lookup *lookups)
+{
+	const struct lookup *lookup;
+	struct lookup_table *table, **ptable;
+	struct rpn_tok name;
+	int n, j;
+
+	for (lookup = lookups; lookup->str && lookup->str[0]; ++lookup) {
+		if (!lookup->run || lookup->pops < 0 || lookup->pushes < 0 ||
+				lookup->xpushes < 0 || lookup->privsize < 0) {
+			mylog(LOG_WARNING, "operator '%s' is incomplete", lookup->str);
+			return -1;
+		}
+		name.str = lookup->str;
+		name.len = strlen(lookup->str);
+		if (lookup_find(&name) || memchr(name.str, ',', name.len)) {
+			mylog(LOG_WARNING, "operator '%s' exists or is invalid", lookup->str);
+			return -1;
+		}
+		for (j = 0; j < lookup - lookups; ++j) {
+			if (!strcmp(lookups[j].str, lookup->str)) {
+				mylog(LOG_WARNING, "operator '%s' duplicated", lookup->str);
+				return -1;
+			}
+		}
 	}
+	n = lookup - lookups;
+
+	table = calloc(1, sizeof(*table) + sizeof(table->profs[0])*n);
+	if (!table)
+		mylog(LOG_ERR, "calloc lookup table %i", n);
+	table->lookups = lookups;
+	table->n = n;
+	for (j = 0; j < n; ++j)
+		table->profs[j].name = lookups[j].str;
+	/* append, the builtin table remains first */
+	for (ptable = &lookup_tables; *ptable; ptable = &(*ptable)->next);
+	*ptable = table;
+
+	lookup_index = realloc(lookup_index, sizeof(*lookup_index)*(nlookup_index+n));
+	if (!lookup_index)
+		mylog(LOG_ERR, "realloc lookup index %i", nlookup_index+n);
+	for (j = 0; j < n; ++j)
+		lookup_index[nlookup_index++] = lookups+j;
+	qsort(lookup_index, nlookup_index, sizeof(*lookup_index), lookupcmp);
+	return 0;
+}
 
-	for (lookup = lookups; lookup->str[0]; ++lookup) {
-		if (!strcmp(lookup->str, tok))
-			return lookup;
+int rpn_add_lookups(const struct lookup *lookups, int version)
+{
+	if (version != RPN_LOOKUP_VERSION) {
+		mylog(LOG_WARNING, "operators of version %i, expected %i", version, RPN_LOOKUP_VERSION);
+		return -1;
 	}
-	return NULL;
+	return lookup_register(lookups);
+}
+
+/* built before main, so parsing needs no locking */
+__attribute__((constructor))
+static void rpn_index_lookups(void)
+{
+	lookup_register(lookups);
+}
+
+/* find the operator of @tok, its arguments after ',' go into @args */
+static const struct lookup *do_lookup(const struct rpn_tok *tok, struct rpn_tok *args)
+{
+	struct rpn_tok name = *tok;
+	const char *sep;
+
+	sep = memchr(tok->str, ',', tok->len);
+	if (sep) {
+		name.len = sep - tok->str;
+		args->str = sep+1;
+		args->len = tok->len - name.len - 1;
+	} else {
+		args->str = NULL;
+		args->len = 0;
+	}
+	return lookup_find(&name);
 }
 
 static void free_lookup(struct rpn *rpn)
@@ -1548,89 +3813,110 @@ static void free_lookup(struct rpn *rpn)
 		rpn->lookup->free(rpn);
 }
 
+/* sorted by name, for bsearch */
 static struct constant {
 	const char *name;
 	double value;
 } const constants[] = {
-	{ "pi", M_PI, },
 	{ "e", M_E, },
-	{ "", NAN, },
+	{ "pi", M_PI, },
 };
 
-static const struct constant *do_constant(const char *tok)
+static struct aggrop {
+	const char *name;
+	int kind;
+} const aggrops[] = {
+	/* sorted by name, for bsearch */
+	{ "all", AGGR_ALL, },
+	{ "any", AGGR_ANY, },
+	{ "avg", AGGR_AVG, },
+	{ "count", AGGR_COUNT, },
+	{ "max", AGGR_MAX, },
+	{ "min", AGGR_MIN, },
+	{ "sum", AGGR_SUM, },
+};
+
+/* compare a token with the name, which is the first member */
+static int namekeycmp(const void *key, const void *b)
 {
-	const struct constant *lp;
+	return tokcmp(key, *(const char *const *)b);
+}
 
-	for (lp = constants; *lp->name; ++lp) {
-		if (!strcmp(lp->name, tok))
-			return lp;
-	}
-	return NULL;
+static const struct aggrop *do_aggrop(const struct rpn_tok *tok)
+{
+	return bsearch(tok, aggrops, sizeof(aggrops)/sizeof(aggrops[0]), sizeof(aggrops[0]), namekeycmp);
 }
 
-/* modified strtok:
- * don't seperate between " chars
- * This keeps the " characters in the string.
+static const struct constant *do_constant(const struct rpn_tok *tok)
+{
+	return bsearch(tok, constants, sizeof(constants)/sizeof(constants[0]), sizeof(constants[0]), namekeycmp);
+}
+
+/* next token at *pstr, separated by spaces or tabs.
+ * Spaces between " chars don't seperate,
+ * the " characters remain in the token.
+ * Returns the length, 0 at the end.
  */
-static char *mystrtok(char *newstr, const char *sep)
+static int rpn_next_tok(const char **pstr, struct rpn_tok *tok)
 {
-	static char *str;
-	char *savedstr = NULL;
+	const char *str = *pstr + strspn(*pstr, " \t");
 	int instring = 0;
 
-	if (newstr)
-		str = newstr;
+	tok->str = str;
 	for (; *str; ++str) {
-		if (!instring && strchr(sep, *str)) {
-			if (savedstr) {
-				/* end reached */
-				*str++ = 0;
-				return savedstr;
-			}
-		} else {
-			if (!savedstr)
-				savedstr = str;
-			if (*str == '"')
-				instring = !instring;
-		}
+		if (!instring && (*str == ' ' || *str == '\t'))
+			break;
+		if (*str == '"')
+			instring = !instring;
 	}
-	return savedstr;
+	tok->len = str - tok->str;
+	*pstr = str;
+	return tok->len;
 }
 
 int rpn_parse_append(const char *cstr, struct rpn **proot, void *dat)
 {
-	char *savedstr;
-	char *tok, *endp;
-	int result;
+	struct rpn_tok tok, args;
+	int result, isnum, len;
 	struct rpn *last = NULL, *rpn, **localproot;
 	const struct lookup *lookup;
 	const struct constant *constant;
+	const struct aggrop *aggrop;
 	double tmp;
 
 	/* find current 'last' rpn */
 	for (last = *proot; last && last->next; last = last->next);
 	localproot = last ? &last->next : proot;
 	/* parse */
-	savedstr = strdup(cstr);
-	for (tok = mystrtok(savedstr, " \t"), result = 0; tok;
-			tok = mystrtok(NULL, " \t"), ++result) {
+	for (result = 0; rpn_next_tok(&cstr, &tok); ++result) {
+		if (last && last->run == rpn_do_env && is_wildcard(last->topic) &&
+				(aggrop = do_aggrop(&tok)) != NULL) {
+			/* turn the wildcard reference into an aggregate */
+			last->run = rpn_do_aggr;
+			last->cookie = aggrop->kind;
+			last->flags |= RPNFN_LOGIC;
+			continue;
+		}
 		rpn = rpn_create();
-		tmp = mystrtod(tok, &endp);
-		if ((endp > tok) && !*endp) {
+		/* default stack effect, for constants & topics */
+		rpn->pushes = 1;
+		tmp = rpn_strntod(tok.str, tok.len, &isnum);
+		if (isnum) {
 			rpn->run = rpn_do_const;
 			rpn->value = tmp;
 
-		} else if (*tok == '"') {
-			if (tok[strlen(tok)-1] == '"')
-				tok[strlen(tok)-1] = 0;
-			++tok;
+		} else if (*tok.str == '"') {
+			/* strip the quotes */
+			len = tok.len - 1;
+			if (len && tok.str[tok.len-1] == '"')
+				--len;
 			rpn->run = rpn_do_const;
-			rpn->constvalue = strdup(tok);
-			rpn->value = mystrtod(tok, NULL);
+			rpn->constvalue = strndup(tok.str+1, len);
+			rpn->value = mystrtod(rpn->constvalue, NULL);
 
-		} else if (strchr("$>=", *tok) && tok[1] == '{' && tok[strlen(tok)-1] == '}') {
-			rpn->topic = strndup(tok+2, strlen(tok+2)-1);
-			switch (*tok) {
+		} else if (strchr("$>=", *tok.str) && tok.str[1] == '{' && tok.str[tok.len-1] == '}') {
+			rpn->topic = strndup(tok.str+2, tok.len-3);
+			switch (*tok.str) {
 			case '$':
 				rpn->run = rpn_do_env;
 				break;
@@ -1642,21 +3928,31 @@ int rpn_parse_append(const char *cstr, struct rpn **proot, void *dat)
 				rpn->run = rpn_do_writeenv;
 				break;
 			}
-		} else if ((lookup = do_lookup(tok, &endp)) != NULL) {
+			if (rpn->run == rpn_do_writeenv) {
+				rpn->pops = 1;
+				rpn->pushes = 0;
+			}
+		} else if ((lookup = do_lookup(&tok, &args)) != NULL) {
 			rpn->run = lookup->run;
 			rpn->flags = lookup->flags;
 			rpn->lookup = lookup;
+			rpn->pops = lookup->pops;
+			rpn->pushes = lookup->pushes;
+			rpn->xpushes = lookup->xpushes;
 			if (lookup->privsize)
-				rpn = rpn_grow(rpn, lookup->privsize);
-			if (lookup->parse)
-				lookup->parse(rpn, endp);
-		} else if ((constant = do_constant(tok)) != NULL) {
+				rpn_alloc_priv(rpn, lookup->privsize);
+			if (lookup->parse && lookup->parse(rpn, args.str, args.len) < 0) {
+				mylog(LOG_INFO | LOG_MQTT, "bad arguments in '%.*s'", tok.len, tok.str);
+				rpn_free(rpn);
+				goto failed;
+			}
+		} else if ((constant = do_constant(&tok)) != NULL) {
 			rpn->run = rpn_do_const;
 			rpn->value = constant->value;
-			rpn->constvalue = strdup(tok);
+			rpn->constvalue = strndup(tok.str, tok.len);
 
 		} else {
-			mylog(LOG_INFO | LOG_MQTT, "unknown token '%s'", tok);
+			mylog(LOG_INFO | LOG_MQTT, "unknown token '%.*s'", tok.len, tok.str);
 			rpn_free(rpn);
 			goto failed;
 		}
@@ -1667,7 +3963,6 @@ int rpn_parse_append(const char *cstr, struct rpn **proot, void *dat)
 			*proot = rpn;
 		last = rpn;
 	}
-	free(savedstr);
 	return result;
 
 failed:
@@ -1676,17 +3971,66 @@ failed:
 	return -1;
 }
 
-void rpn_parse_done(struct rpn *root)
+/* bind history operators to the topic of their 1st operand,
+ * as in '${TOPIC} PERIOD op'. PERIOD may be computed.
+ * A simulated stack holds the topic reference that produced
+ * each element, or NULL.
+ */
+static int rpn_bind_history(struct rpn *root)
+{
+	struct rpn **sim = NULL, *rpn, *src;
+	int n = 0, s = 0, j, ret = 0;
+
+	for (rpn = root; rpn; rpn = rpn->next) {
+		if (rpn->flags & RPNFN_HISTORY) {
+			src = (n >= 2) ? sim[n-2] : NULL;
+			if (!src || is_wildcard(src->topic)) {
+				mylog(LOG_INFO | LOG_MQTT, "%s needs '${TOPIC} PERIOD %s'", rpn->lookup->str, rpn->lookup->str);
+				ret = -1;
+			} else if (!rpn->topic)
+				rpn->topic = strdup(src->topic);
+		}
+		if (rpn->run == rpn_do_if || rpn->run == rpn_do_else || rpn->run == rpn_do_fi || rpn->xpushes) {
+			/* the stack depends on the path taken */
+			n = 0;
+			continue;
+		}
+		n = (n > rpn->pops) ? n - rpn->pops : 0;
+		if (n + rpn->pushes > s) {
+			s = n + rpn->pushes + 16;
+			sim = realloc(sim, sizeof(*sim)*s);
+			if (!sim)
+				mylog(LOG_ERR, "realloc history binding %i", s);
+		}
+		for (j = 0; j < rpn->pushes; ++j)
+			sim[n++] = (rpn->run == rpn_do_env) ? rpn : NULL;
+	}
+	if (sim)
+		free(sim);
+	return ret;
+}
+
+int rpn_parse_done(struct rpn *root)
 {
-	struct rpn *rpn;
+	struct rpn *rpn, *prev = NULL;
 
+	if (rpn_bind_history(root) < 0)
+		return -1;
 	/* do static tests */
-	for (rpn = root; rpn; rpn = rpn->next) {
-		if (rpn->run == rpn_do_if)
+	for (rpn = root; rpn; prev = rpn, rpn = rpn->next) {
+		if (rpn->run == rpn_do_env && is_wildcard(rpn->topic))
+			mylog(LOG_INFO | LOG_MQTT, "${%s} without aggregate", rpn->topic);
+		else if (rpn->run == rpn_do_json && prev && prev->run == rpn_do_const && prev->constvalue)
+			/* compile the member path now */
+			compile_jsonpath(rpn, prev->constvalue);
+		else if (rpn->run == rpn_do_if)
 			rpn_test_if(rpn);
 		else if (rpn->run == rpn_do_else)
 			rpn_test_else(rpn);
 	}
+	if (root)
+		rpn_compile(root);
+	return 0;
 }
 
 struct rpn *rpn_parse(const char *cstr, void *dat)
@@ -1694,7 +4038,10 @@ struct rpn *rpn_parse(const char *cstr, void *dat)
 	struct rpn *rpns = NULL;
 
 	rpn_parse_append(cstr, &rpns, dat);
-	rpn_parse_done(rpns);
+	if (rpn_parse_done(rpns) < 0) {
+		rpn_free_chain(rpns);
+		return NULL;
+	}
 	return rpns;
 }
 
@@ -1,6 +1,8 @@
 #ifndef _RPNLOGIC_H_
 #define _RPNLOGIC_H_
 
+#include <stdio.h>
+
 struct stack {
 	struct rpn_el {
 		double d;
@@ -8,8 +10,14 @@ struct stack {
 	} *v /* element array */;
 	int n; /* used elements */
 	int s; /* allocated elements */
-	struct rpn *jumpto;
 	int errnum;
+	/* arena for strings produced during 1 evaluation,
+	 * emptied by rpn_stack_reset
+	 */
+	struct rpn_strchunk *chunks, *chunk;
+	int used; /* bytes used in chunk */
+	/* tokens of the last parsed json document */
+	struct rpn_jsoncache *json;
 };
 
 struct rpn {
@@ -26,29 +34,153 @@ struct rpn {
 	void (*timeout)(void *dat); /* scheduled timeout,
 				       usefull to free resources */
 	const struct lookup *lookup;
-	/* ... private date to come */
+	/* stack effect: elements consumed, produced & optionally produced */
+	int pops, pushes, xpushes;
+	void *priv; /* private data of lookup */
+	int privpacked; /* priv lives in the program's side array */
+	struct rpn_prog *prog; /* compiled program, on the first rpn */
 };
 
-/* functions */
+/* functions
+ * Parsing is reentrant: different chains may be parsed
+ * on different threads at once.
+ */
 int rpn_parse_append(const char *cstr, struct rpn **proot, void *dat);
-void rpn_parse_done(struct rpn *root);
+/* finish the chain, return < 0 when it cannot run */
+int rpn_parse_done(struct rpn *root);
 
 struct rpn *rpn_parse(const char *cstr, void *dat);
 
 void rpn_stack_reset(struct stack *st);
+void rpn_stack_free(struct stack *st);
 int rpn_run(struct stack *st, struct rpn *rpn);
 
 void rpn_free_chain(struct rpn *rpn);
+/* invalidate cached results that depend on @topic, NULL for all */
+void rpn_env_changed(struct rpn *root, const char *topic);
 void rpn_rebase(struct rpn *first, struct rpn **newptr);
 
 int rpn_collect_flags(struct rpn *);
 #define RPNFN_PERIODIC	1 /* This will generate output without external events */
 #define RPNFN_WALLTIME	2 /* depends on wall time */
 #define RPNFN_LOGIC 4 /* no plain copy or constant */
+#define RPNFN_EVENT	8 /* needs every input event, also unchanged values */
+#define RPNFN_HISTORY	16 /* uses the history of rpn->topic */
+#define RPNFN_PURE	32 /* result depends only on the operands */
+
+/* profiler, for all programs of the process */
+void rpn_profile_enable(int enable);
+void rpn_profile_reset(void);
+/* write executions & cycles per operator, most expensive first */
+void rpn_profile_dump(FILE *fp);
+
+/* cached result of a pure segment */
+struct rpn_seg {
+	double value;
+	int valid;
+	int ndeps;
+	struct rpn **deps; /* topic references */
+};
+
+/* natively compiled programs, generated by rpn2c
+ * @me holds the rpn of each instruction of the compiled program.
+ * Bump RPN_NATIVE_VERSION when the structs above change.
+ */
+#define RPN_NATIVE_VERSION	1
+struct rpn_native {
+	const char *sig; /* signature of the compiled program */
+	int (*run)(struct stack *st, struct rpn *const *me, struct rpn_seg *segs);
+};
+/* register a table of natives, terminated by an empty entry */
+void rpn_add_natives(const struct rpn_native *natives);
+/* signature of @root, to be freed by the caller */
+char *rpn_native_signature(struct rpn *root);
+/* emit C function @name for @root, return < 0 if not possible */
+int rpn_emit_c(FILE *fp, struct rpn *root, const char *name);
+
+/* operators
+ * Besides the builtin ones, tables of operators can be added with
+ * rpn_add_lookups, i.e. from a plugin. A plugin exports
+ *	const int rpn_plugin_version = RPN_LOOKUP_VERSION;
+ *	const struct lookup rpn_plugin_lookups[] = { ..., { "", }, };
+ * Bump RPN_LOOKUP_VERSION when struct stack, rpn or lookup change.
+ */
+#define RPN_LOOKUP_VERSION	1
+struct lookup {
+	const char *str;
+	void (*run)(struct stack *, struct rpn *);
+	/* stack effect */
+	int pops, pushes;
+	int flags;
+	int privsize;
+	void (*free)(struct rpn *);
+	/* arguments after ',', NULL when absent, return < 0 when invalid */
+	int (*parse)(struct rpn *, const char *str, int len);
+	int xpushes; /* optional extra pushes */
+};
+/* register @table, terminated by an empty or NULL name, built for @version.
+ * Names may not exist yet, each operator needs run and a stack effect >= 0.
+ * Register before parsing.
+ * return < 0 on failure
+ */
+int rpn_add_lookups(const struct lookup *table, int version);
+
+/* for operators */
+static inline void *rpn_priv(struct rpn *rpn)
+{
+	return rpn->priv;
+}
+
+/* stack access is unchecked:
+ * rpn_run reserved the maximum depth of the program,
+ * and verified the pops of each operator
+ */
+static inline void rpn_push_el(struct stack *st, const struct rpn_el *el)
+{
+	st->v[st->n++] = *el;
+}
+
+static inline void rpn_push_str(struct stack *st, const char *str, double value)
+{
+	st->v[st->n].a = str;
+	st->v[st->n++].d = value;
+}
+static inline void rpn_push(struct stack *st, double value)
+{
+	rpn_push_str(st, NULL, value);
+}
+static inline struct rpn_el *rpn_pop1(struct stack *st)
+{
+	return st->v + --st->n;
+}
+static inline void rpn_pop(struct stack *st, int n)
+{
+	st->n -= n;
+}
+static inline struct rpn_el *rpn_n(struct stack *st, int idx)
+{
+	return st->v+st->n+idx;
+}
+
+/* aggregate over all topics matching an MQTT wildcard */
+struct rpn_aggr {
+	int nmembers; /* matching topics */
+	int nnum; /* members with a numeric value */
+	int ntrue; /* members with a non-zero value */
+	double sum; /* sum of numeric values */
+	double min, max;
+};
 
 /* imported function */
-extern const char *rpn_lookup_env(const char *str, struct rpn *);
+/* return the string value of @str, and its numeric value in *pvalue */
+extern const char *rpn_lookup_env(const char *str, struct rpn *, double *pvalue);
 extern int rpn_write_env(const char *value, const char *str, struct rpn *);
+/* return the aggregate for wildcard @pattern, NULL if unknown */
+extern const struct rpn_aggr *rpn_lookup_aggr(const char *pattern, struct rpn *);
+/* value of @topic at time @t, in libt_now() timebase */
+extern double rpn_history_value(const char *topic, double t, struct rpn *);
+/* time-integral of @topic between @from and @to */
+extern double rpn_history_integral(const char *topic, double from, double to, struct rpn *);
 extern int rpn_env_isnew(void);
 extern void rpn_run_again(void *dat); /* dat is the calling rpn * */
 
@@ -0,0 +1,395 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <locale.h>
+#include <syslog.h>
+
+#include <mosquitto.h>
+
+#include "vlibt.h"
+#include "rpnlogic.h"
+#include "history.h"
+#include "aggr.h"
+#include "common.h"
+
+#define NAME "rpnreplay"
+#ifndef VERSION
+#define VERSION "<undefined version>"
+#endif
+
+/* program options */
+static const char help_msg[] =
+	NAME ": replay recorded topics through rpn logic\n"
+	"usage:	" NAME " [OPTIONS ...] LOGIC [FILE]\n"
+	"\n"
+	"Options\n"
+	" -V, --version		Show version\n"
+	" -v, --verbose		Be more verbose\n"
+	" -a, --all		Output every evaluation, not only changes\n"
+	" -o, --output=TOPIC	Name of the logic's output (default 'out')\n"
+	"\n"
+	"Paramteres\n"
+	" LOGIC		rpn logic, as for mqttlogic\n"
+	" FILE		CSV input (default stdin). The first line names the columns:\n"
+	"		time,TOPIC,... Each next line holds the time in seconds\n"
+	"		and the new values. Empty fields leave a topic unchanged.\n"
+	"		Lines that go back in time are skipped.\n"
+	"		Wildcard aggregates run over the columns,\n"
+	"		ago & integral over their history.\n"
+	"\n"
+	"Output is CSV: time,topic,value for each change of the logic's output\n"
+	"and each write by the logic.\n"
+	;
+
+#ifdef _GNU_SOURCE
+static struct option long_opts[] = {
+	{ "help", no_argument, NULL, '?', },
+	{ "version", no_argument, NULL, 'V', },
+	{ "verbose", no_argument, NULL, 'v', },
+	{ "all", no_argument, NULL, 'a', },
+	{ "output", required_argument, NULL, 'o', },
+
+	{ },
+};
+#else
+#define getopt_long(argc, argv, optstring, longopts, longindex) \
+	getopt((argc), (argv), (optstring))
+#endif
+static const char optstring[] = "Vv?ao:";
+
+#define HISTORY_SIZE	(1024*1024)
+
+static int loglevel = LOG_WARNING;
+static int allout;
+static const char *outname = "out";
+
+/* input columns */
+struct column {
+	char *topic;
+	char *value;
+	int len, size;
+	double num;
+	int numeric;
+	int isnew;
+	struct history *hist;
+};
+static struct column *cols;
+static int ncols;
+
+/* rpn topic string to column, by pointer */
+static struct colref {
+	const char *key;
+	struct column *col;
+} *colrefs;
+static int ncolrefs, scolrefs;
+
+static struct column *lastcol;
+
+/* wildcard aggregates over the columns */
+static struct aggr **aggrs;
+static int naggrs;
+
+/* logic */
+static struct rpn *logic;
+static int logicflags;
+static struct stack rpnstack;
+static char *lastvalue;
+
+static struct column *find_column(const char *topic)
+{
+	struct column *col;
+	int j;
+
+	for (j = 0; j < ncolrefs; ++j) {
+		if (colrefs[j].key == topic)
+			return colrefs[j].col;
+	}
+	for (col = NULL, j = 0; j < ncols; ++j) {
+		if (!strcmp(cols[j].topic, topic)) {
+			col = cols+j;
+			break;
+		}
+	}
+	if (ncolrefs >= scolrefs) {
+		scolrefs = scolrefs*2 ?: 16;
+		colrefs = realloc(colrefs, sizeof(*colrefs)*scolrefs);
+		if (!colrefs)
+			mylog(LOG_ERR, "realloc colrefs %i: %s", scolrefs, ESTR(errno));
+	}
+	colrefs[ncolrefs].key = topic;
+	colrefs[ncolrefs++].col = col;
+	return col;
+}
+
+/* imports for rpnlogic */
+const char *rpn_lookup_env(const char *str, struct rpn *rpn, double *pvalue)
+{
+	struct column *col = find_column(str);
+
+	lastcol = col;
+	if (!col || !col->value)
+		return NULL;
+	*pvalue = col->num;
+	return col->value;
+}
+
+int rpn_write_env(const char *value, const char *str, struct rpn *rpn)
+{
+	printf("%.3f,%s,%s\n", libt_now(), str, value);
+	return 0;
+}
+
+static int topic_matches(const char *pattern, const char *topic)
+{
+	bool result;
+
+	if (mosquitto_topic_matches_sub(pattern, topic, &result))
+		return 0;
+	return result;
+}
+
+static void aggr_update(struct column *col, int add)
+{
+	int j;
+
+	if (!col->value)
+		return;
+	for (j = 0; j < naggrs; ++j) {
+		if (topic_matches(aggrs[j]->pattern, col->topic))
+			aggr_add_value(aggrs[j], col->numeric, col->num, add);
+	}
+}
+
+const struct rpn_aggr *rpn_lookup_aggr(const char *pattern, struct rpn *rpn)
+{
+	struct aggr *aggr;
+	int j;
+
+	for (j = 0; j < naggrs; ++j) {
+		if (!strcmp(aggrs[j]->pattern, pattern))
+			return &aggrs[j]->v;
+	}
+	aggr = aggr_new(pattern);
+	for (j = 0; j < ncols; ++j) {
+		if (cols[j].value && topic_matches(pattern, cols[j].topic))
+			aggr_add_value(aggr, cols[j].numeric, cols[j].num, +1);
+	}
+	aggrs = realloc(aggrs, sizeof(*aggrs)*(naggrs+1));
+	if (!aggrs)
+		mylog(LOG_ERR, "realloc aggrs: %s", ESTR(errno));
+	aggrs[naggrs++] = aggr;
+	return &aggr->v;
+}
+
+double rpn_history_value(const char *topic, double t, struct rpn *rpn)
+{
+	struct column *col = find_column(topic);
+
+	return col ? history_value(col->hist, t) : NAN;
+}
+
+double rpn_history_integral(const char *topic, double from, double to, struct rpn *rpn)
+{
+	struct column *col = find_column(topic);
+
+	return col ? history_integral(col->hist, from, to) : NAN;
+}
+
+int rpn_env_isnew(void)
+{
+	return lastcol && lastcol->isnew;
+}
+
+static void do_logic(struct column *trigger)
+{
+	const char *result;
+
+	lastcol = NULL;
+	rpn_stack_reset(&rpnstack);
+	if (trigger)
+		trigger->isnew = 1;
+	if (rpn_run(&rpnstack, logic) < 0)
+		mylog(LOG_INFO, "%.3f: logic failed", libt_now());
+	if (trigger)
+		trigger->isnew = 0;
+	if (rpnstack.errnum || !rpnstack.n)
+		return;
+	result = rpnstack.v[rpnstack.n-1].a ?: mydtostr(rpnstack.v[rpnstack.n-1].d);
+	if (!allout && lastvalue && !strcmp(lastvalue, result))
+		return;
+	printf("%.3f,%s,%s\n", libt_now(), outname, result);
+	if (lastvalue)
+		free(lastvalue);
+	lastvalue = strdup(result);
+}
+
+void rpn_run_again(void *dat)
+{
+	do_logic(NULL);
+}
+
+/* set a new value, return 0 when unchanged */
+static int column_set_value(struct column *col, const char *value, int len)
+{
+	char *endp;
+
+	if (col->value && col->len == len && !memcmp(col->value, value, len))
+		return 0;
+	aggr_update(col, -1);
+	if (len+1 > col->size) {
+		col->size = (len+1+63) & ~63;
+		col->value = realloc(col->value, col->size);
+		if (!col->value)
+			mylog(LOG_ERR, "realloc value %i: %s", col->size, ESTR(errno));
+	}
+	memcpy(col->value, value, len);
+	col->value[len] = 0;
+	col->len = len;
+	col->num = mystrtod(col->value, &endp);
+	/* as mqttlogic, keep nan & inf out of the aggregates */
+	col->numeric = endp > col->value && !*endp && isfinite(col->num);
+	aggr_update(col, +1);
+	history_add(col->hist, libt_now(), col->num);
+	return 1;
+}
+
+static void parse_header(char *line)
+{
+	char *tok;
+
+	/* first column is the time */
+	strsep(&line, ",");
+	for (tok = strsep(&line, ","); tok; tok = strsep(&line, ",")) {
+		cols = realloc(cols, sizeof(*cols)*(ncols+1));
+		if (!cols)
+			mylog(LOG_ERR, "realloc columns: %s", ESTR(errno));
+		memset(cols+ncols, 0, sizeof(*cols));
+		cols[ncols].hist = history_new();
+		cols[ncols++].topic = strdup(tok);
+	}
+}
+
+static void replay_line(char *line)
+{
+	char *tok, *endp;
+	double t;
+	int j, len, changed;
+
+	t = strtod(line, &endp);
+	if (endp == line || (*endp && *endp != ','))
+		mylog(LOG_ERR, "bad time '%s'", line);
+	if (t < libt_now()) {
+		/* rewinding the clock would confuse all timers */
+		mylog(LOG_WARNING, "time goes back from %.3f to %.3f, line skipped", libt_now(), t);
+		return;
+	}
+	/* timeouts that expire before this sample */
+	vlibt_run_until(t);
+	line = *endp ? endp+1 : NULL;
+
+	for (j = 0; line && j < ncols; ++j) {
+		tok = line;
+		line = strchr(line, ',');
+		len = line ? line - tok : strlen(tok);
+		if (line)
+			++line;
+		if (!len)
+			/* no new value */
+			continue;
+		changed = column_set_value(cols+j, tok, len);
+		if (changed)
+			rpn_env_changed(logic, cols[j].topic);
+		if (changed || (logicflags & RPNFN_EVENT))
+			do_logic(cols+j);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	FILE *fp;
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t len;
+
+	/* argument parsing */
+	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
+	switch (opt) {
+	case 'V':
+		fprintf(stderr, "%s %s\nCompiled on %s %s\n",
+				NAME, VERSION, __DATE__, __TIME__);
+		exit(0);
+	case 'v':
+		++loglevel;
+		break;
+	case 'a':
+		allout = 1;
+		break;
+	case 'o':
+		outname = optarg;
+		break;
+
+	default:
+		fprintf(stderr, "unknown option '%c'\n", opt);
+	case '?':
+		fputs(help_msg, stderr);
+		exit(1);
+		break;
+	}
+
+	if (optind >= argc) {
+		fputs(help_msg, stderr);
+		exit(1);
+	}
+	myopenlog(NAME, 0, LOG_LOCAL2);
+	myloglevel(loglevel);
+	setlocale(LC_TIME, "");
+	/* every column keeps a history, replays are short */
+	history_init(HISTORY_SIZE);
+
+	logic = rpn_parse(argv[optind++], NULL);
+	if (!logic)
+		mylog(LOG_ERR, "no logic");
+	logicflags = rpn_collect_flags(logic);
+
+	if (optind < argc) {
+		fp = fopen(argv[optind], "r");
+		if (!fp)
+			mylog(LOG_ERR, "fopen %s: %s", argv[optind], ESTR(errno));
+	} else
+		fp = stdin;
+
+	/* header */
+	len = getline(&line, &linesize, fp);
+	if (len <= 0)
+		mylog(LOG_ERR, "no header");
+	if (line[len-1] == '\n')
+		line[--len] = 0;
+	if (len && line[len-1] == '\r')
+		line[--len] = 0;
+	parse_header(line);
+
+	vlibt_set_now(NAN);
+	for (;;) {
+		len = getline(&line, &linesize, fp);
+		if (len < 0)
+			break;
+		if (len && line[len-1] == '\n')
+			line[--len] = 0;
+		if (len && line[len-1] == '\r')
+			line[--len] = 0;
+		if (!len || *line == '#')
+			continue;
+		if (isnan(libt_now()))
+			/* start the clock at the first sample */
+			vlibt_set_now(strtod(line, NULL));
+		replay_line(line);
+	}
+	fflush(stdout);
+	return 0;
+}
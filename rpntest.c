@@ -1,8 +1,10 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <unistd.h>
+#include <dlfcn.h>
 #include <locale.h>
 #include <poll.h>
 #include <syslog.h>
@@ -11,15 +13,31 @@
 #include "rpnlogic.h"
 #include "common.h"
 
-const char *rpn_lookup_env(const char *str, struct rpn *rpn)
+const char *rpn_lookup_env(const char *str, struct rpn *rpn, double *pvalue)
 {
-	return getenv(str);
+	const char *value = getenv(str);
+
+	if (value)
+		*pvalue = mystrtod(value, NULL);
+	return value;
 }
 int rpn_write_env(const char *value, const char *str, struct rpn *rpn)
 {
 	printf("%c{%s} '%s'\n", rpn->cookie ? '=' : '>', str, value);
 	return 0;
 }
+const struct rpn_aggr *rpn_lookup_aggr(const char *pattern, struct rpn *rpn)
+{
+	return NULL;
+}
+double rpn_history_value(const char *topic, double t, struct rpn *rpn)
+{
+	return NAN;
+}
+double rpn_history_integral(const char *topic, double from, double to, struct rpn *rpn)
+{
+	return NAN;
+}
 int rpn_env_isnew(void)
 {
 	return 0;
@@ -42,6 +60,26 @@ static void my_rpn_run(struct rpn *rpn)
 	}
 	printf("\n");
 	fflush(stdout);
+	rpn_stack_free(&rpnstack);
+}
+
+/* logic compiled by rpn2c */
+static void load_natives(const char *file)
+{
+	void *dl;
+	const int *version;
+	const struct rpn_native *natives;
+
+	dl = dlopen(file, RTLD_NOW);
+	if (!dl)
+		mylog(LOG_ERR, "dlopen %s: %s", file, dlerror());
+	version = dlsym(dl, "rpn_native_version");
+	natives = dlsym(dl, "rpn_natives");
+	if (!version || !natives)
+		mylog(LOG_ERR, "%s: no rpn natives", file);
+	if (*version != RPN_NATIVE_VERSION)
+		mylog(LOG_ERR, "%s: version %i, expected %i", file, *version, RPN_NATIVE_VERSION);
+	rpn_add_natives(natives);
 }
 
 void rpn_run_again(void *dat)
@@ -55,17 +93,28 @@ void rpn_run_again(void *dat)
 int main(int argc, char *argv[])
 {
 	struct rpn *rpn = NULL;
+	int profile = 0;
 
 	myopenlog("rpntest", 0, LOG_LOCAL2);
 	myloglevel(LOG_INFO);
 	setlocale(LC_TIME, "");
 
+	if (argv[1] && !strcmp(argv[1], "-p")) {
+		/* profile the operators, dump on stderr */
+		profile = 1;
+		rpn_profile_enable(1);
+		++argv;
+	}
+	if (argv[1] && !strcmp(argv[1], "-N") && argv[2]) {
+		/* run natives from rpn2c */
+		load_natives(argv[2]);
+		argv += 2;
+	}
 	for (++argv; *argv; ++argv) {
 		if (rpn_parse_append(*argv, &rpn, &rpn) < 0)
 			return 1;
 	}
-	rpn_parse_done(rpn);
-	if (!rpn)
+	if (!rpn || rpn_parse_done(rpn) < 0)
 		return 1;
 
 	my_rpn_run(rpn);
@@ -73,5 +122,7 @@ int main(int argc, char *argv[])
 		poll(NULL, 0, libt_get_waittime());
 		libt_flush();
 	}
+	if (profile)
+		rpn_profile_dump(stderr);
 	return 0;
 }
@@ -0,0 +1,32 @@
+#!/bin/sh
+# a "nan" member must not poison a wildcard aggregate
+# needs an MQTT broker on $MQTT_HOST and the mosquitto clients
+HOST=${MQTT_HOST:-localhost}
+P=test/aggrnan/$$
+
+if ! command -v mosquitto_pub >/dev/null || ! mosquitto_pub -h $HOST -t $P -n 2>/dev/null; then
+	echo "skip: no MQTT broker on $HOST"
+	exit 0
+fi
+
+./mqttlogic -m $HOST "$P/#" &
+pid=$!
+cleanup() {
+	kill $pid
+	mosquitto_pub -h $HOST -t $P/out/logic -r -n
+	mosquitto_pub -h $HOST -t $P/out -r -n
+}
+trap cleanup EXIT
+sleep 0.5
+
+mosquitto_pub -h $HOST -t $P/out/logic -r -m "\${$P/v/+} avg"
+mosquitto_pub -h $HOST -t $P/v/a -m 2
+mosquitto_pub -h $HOST -t $P/v/b -m nan
+mosquitto_pub -h $HOST -t $P/v/b -m 4
+sleep 0.5
+
+result=$(mosquitto_sub -h $HOST -t $P/out -C 1 -W 2)
+if [ "$result" != 3 ]; then
+	echo "avg of 2 & 4 after nan: got '$result', expected 3"
+	exit 1
+fi
@@ -0,0 +1,20 @@
+#!/bin/sh
+# wildcard aggregates, over rpnreplay columns
+# nan counts as member, but not as number
+
+result=$(printf '%s\n' time,room/a/temp,room/b/temp,room/c/temp,hall/temp \
+	0,20,,,5 1,,22,, 2,,,nan, 3,24,,, 4,,,21, 5,,22,, |
+	./rpnreplay '${room/+/temp} avg ${room/+/temp} count ${room/+/temp} min ${room/+/temp} max ${room/+/temp} all jsonobj,avg,count,min,max,all')
+expected='0.000,out,{"avg":20,"count":1,"min":20,"max":20,"all":1}
+1.000,out,{"avg":21,"count":2,"min":20,"max":22,"all":1}
+2.000,out,{"avg":21,"count":3,"min":20,"max":22,"all":0}
+3.000,out,{"avg":23,"count":3,"min":22,"max":24,"all":0}
+4.000,out,{"avg":22.3333,"count":3,"min":21,"max":24,"all":1}'
+
+if [ "$result" != "$expected" ]; then
+	echo "got:"
+	echo "$result"
+	echo "expected:"
+	echo "$expected"
+	exit 1
+fi
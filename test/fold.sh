@@ -0,0 +1,18 @@
+#!/bin/sh
+# constant folding and dead branch removal
+. test/lib.inc
+export A=3
+
+sigcheck '2 3 + 4 *' '0x1.4p+4'
+sigcheck '1 if 2 else 3 fi' '0x1p+1'
+sigcheck '0 if 2 else 3 fi' '0x1.8p+1'
+sigcheck '1 "a" "b" ?:' 'nan\"a\"'
+sigcheck '${A} 1 if 5 fi' 'A/0/1/0 0x1.4p+2'
+# only constant operands fold
+sigcheck '${A} timeofday 2 3 + +' 'A/0/1/0 timeofday/0/1/0 0x1.4p+2 +/2/1/0'
+
+# the results don't change
+rpncheck '2 3 + 4 *' 20
+rpncheck '1 "a" "b" ?:' '"a"'
+rpncheck '${A} 0 if 5 else 6 fi *' 18
+rpncheck '${A} 1 if 5 fi' '"3" 5'
@@ -0,0 +1,40 @@
+#!/bin/sh
+# topic history: ago & integral over rpnreplay columns
+
+fail() {
+	echo "$1: got:"
+	echo "$2"
+	echo "expected:"
+	echo "$3"
+	exit 1
+}
+
+# ago & integral, with a computed period
+result=$(printf '%s\n' time,x 0,1 10,2 20,3 30,4 40,5 |
+	./rpnreplay -a '${x} 5 4 * ago ${x} 30 integral jsonobj,ago,int')
+expected='0.000,out,{"ago":null,"int":0}
+10.000,out,{"ago":null,"int":10}
+20.000,out,{"ago":1,"int":30}
+30.000,out,{"ago":2,"int":60}
+40.000,out,{"ago":3,"int":90}'
+[ "$result" = "$expected" ] || fail ago "$result" "$expected"
+
+# encoding over many blocks: y is the previous x
+result=$(awk 'BEGIN {
+	print "time,y,x"
+	for (j = 0; j < 2000; ++j) {
+		v = sprintf("%.17g", sin(j)*1000/(j+1))
+		if (j % 7 == 0)
+			v = int(v)
+		printf "%i,%s,%s\n", 1000+j*10, p, v
+		p = v
+	}
+}' | ./rpnreplay '${x} 10 ago ${y} ==')
+expected='1000.000,out,1'
+[ "$result" = "$expected" ] || fail history "$result" "$expected"
+
+# without topic operand, the logic is refused
+if ./rpntest '5 10 ago' >/dev/null 2>&1; then
+	echo "ago without topic accepted"
+	exit 1
+fi
@@ -0,0 +1,14 @@
+#!/bin/sh
+# interp tables
+. test/lib.inc
+
+# unsorted points, clamped outside the table
+for x in -5:0 3:30 15:100; do
+	A=${x%:*} rpncheck '${A} interp,10,100,0,0' ${x#*:}
+done
+# equal x make a step
+A=5 rpncheck '${A} interp,0,0,5,0,5,10,10,10' 10
+
+rpnrefused '${A} interp,0,a,10,b'
+rpnrefused '${A} interp,1O,5'
+rpnrefused '${A} interp,0,0,10'
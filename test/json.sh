@@ -0,0 +1,26 @@
+#!/bin/sh
+# json member lookup, with tokens cached over lookups in the same document
+. test/lib.inc
+export J='{"a":{"b":[10,20,{"c":"x y"}]},"d":true,"e":[1,[2,3]],"b":5}' K='[7,8]'
+
+rpncheck '${J} "a/b/1" json' '"20"'
+rpncheck '${J} "a/b/2/c" json' '"x y"'
+rpncheck '${J} "d" json' '"true"'
+rpncheck '${J} "e/1/0" json' '"2"'
+rpncheck '${K} "/1" json' '"8"'
+# missing, out of range, or not a value
+rpncheck '${J} "x" json' ''
+rpncheck '${J} "a/b/9" json' ''
+rpncheck '${J} "a" json' ''
+# "b" of the root, not of "a"
+rpncheck '${J} "b" json' '"5"'
+# alternate between documents
+rpncheck '${J} "b" json ${K} "/0" json + ${J} "e/0" json +' 13
+rpncheck '${J} dup "b" json swap "e/0" json +' 6
+
+# a new value of the same size is parsed again
+result=$(printf '%s\n' time,j '0,{"v":1}' '1,{"v":2}' '2,{"w":3}' |
+	./rpnreplay -a '${j} "v" json')
+expect "new document" "$result" "0.000,out,1
+1.000,out,2
+2.000,out,"
@@ -0,0 +1,21 @@
+#!/bin/sh
+# jsonobj embeds valid json only, and refuses duplicate names
+
+check() {
+	result=$(./rpntest "$1")
+	if [ "$result" != "$2" ]; then
+		echo "$1: got $result, expected $2"
+		exit 1
+	fi
+}
+
+check '1 2 jsonobj,a,b 3 jsonobj,in,c' '"{"in":{"a":1,"b":2},"c":3}"'
+check '"[1,2,null]" jsonobj,k' '"{"k":[1,2,null]}"'
+check '"{x}" jsonobj,k' '"{"k":"{x}"}"'
+check '"[1,tru]" jsonobj,k' '"{"k":"[1,tru]"}"'
+check '"[1,2] [3]" jsonobj,k' '"{"k":"[1,2] [3]"}"'
+
+if ./rpntest '1 2 jsonobj,a,a' >/dev/null 2>&1; then
+	echo "jsonobj,a,a: duplicate name accepted"
+	exit 1
+fi
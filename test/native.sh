@@ -0,0 +1,28 @@
+#!/bin/sh
+# logic compiled by rpn2c runs as interpreted
+. test/lib.inc
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > $dir/logic <<'END'
+${A} 2 * ${B} + 3 max
+${A} 5 > "hi" "lo" ?:
+${A} 5 > if "on" else ${B} 1 + fi
+${A} ${B} dup * swap -
+END
+./rpn2c -o $dir/logic.c $dir/logic || exit 1
+expect natives "$(grep -c '^static int rpn_native_' $dir/logic.c)" 4
+${CC:-cc} -O2 -shared -fPIC -I. -o $dir/logic.so $dir/logic.c -lm || exit 1
+
+for A in 3 7; do
+	export A B=2
+	while read logic; do
+		expect "A=$A '$logic'" "$(./rpntest -N $dir/logic.so "$logic")" "$(./rpntest "$logic")"
+	done < $dir/logic
+done
+
+# the natives really run
+sed "s/d\[1\] = 0x1p+1;/d[1] = 0x1p+2;/" $dir/logic.c > $dir/mod.c
+${CC:-cc} -O2 -shared -fPIC -I. -o $dir/mod.so $dir/mod.c -lm || exit 1
+expect modified "$(A=7 B=2 ./rpntest -N $dir/mod.so '${A} 2 * ${B} + 3 max')" 30
@@ -0,0 +1,46 @@
+#!/bin/sh
+# rmedian & rpercentile against a brute force computation
+. test/lib.inc
+
+# few distinct values, so equal values come & go
+input=$(awk 'BEGIN {
+	srand(5)
+	print "time,x"
+	for (j = 0; j < 2000; ++j)
+		printf "%i,%i\n", j*10 + int(rand()*5), int(rand()*50) - 25
+}')
+
+# window as for running windows, limited to the newest budget samples,
+# percentiles interpolated between ranks
+brute() {
+	awk -v period=$1 -v budget=$2 'BEGIN { FS = ","; n = 0 }
+	function pct(p,  rank, idx) {
+		rank = p * (m - 1)
+		idx = int(rank)
+		if (idx+1 >= m)
+			return w[idx]
+		return w[idx] + (rank - idx) * (w[idx+1] - w[idx])
+	}
+	NR > 1 {
+		t[n] = $1; v[n] = $2; n++
+		for (h = n-1; h > 0 && t[h] > $1 - period; --h);
+		if (h < n - budget)
+			h = n - budget
+		m = 0
+		for (k = h; k < n; ++k) {
+			# insertion sort
+			for (j = m++; j > 0 && w[j-1] > v[k]; --j)
+				w[j] = w[j-1]
+			w[j] = v[k]
+		}
+		printf "%i.000,out,{\"med\":%g,\"p10\":%g,\"p90\":%g}\n", $1, pct(0.5), pct(0.1), pct(0.9)
+	}'
+}
+
+for period in 300 1000; do
+	result=$(echo "$input" | ./rpnreplay -a "\${x} $period rmedian \${x} $period 0.1 rpercentile \${x} $period 0.9 rpercentile jsonobj,med,p10,p90")
+	expect "period $period" "$result" "$(echo "$input" | brute $period 4096)"
+done
+
+result=$(echo "$input" | ./rpnreplay -a '${x} 1000 rmedian,16 ${x} 1000 0.1 rpercentile,16 ${x} 1000 0.9 rpercentile,16 jsonobj,med,p10,p90')
+expect "budget 16" "$result" "$(echo "$input" | brute 1000 16)"
@@ -0,0 +1,21 @@
+#!/bin/sh
+# compiled programs: dispatch, jumps and private data
+# rpntest reads topics from the environment
+. test/lib.inc
+export A=3 B=4 Z=0 S=abc
+
+rpncheck '${A} ${B} + 2 *' 14
+rpncheck '${A} ${B} swap -' 1
+rpncheck '${A} dup *' 9
+rpncheck '${A} ${B} pop' '"3"'
+rpncheck '${A} ${B} ${Z} ?:' '"4"'
+rpncheck '${S}' '"abc"'
+# if/else/fi become jumps
+rpncheck '${A} if 2 else 3 fi' 2
+rpncheck '${Z} if 2 else 3 fi' 3
+rpncheck '${A} if ${Z} if 4 else 5 fi fi' 5
+rpncheck '${Z} if 1 fi 6' 6
+rpncheck '${A} 1 quit 2' '"3" 1'
+# operators with private data, side by side
+rpncheck '${A} interp,0,0,10,100 ${B} interp,0,0,10,10 +' 34
+rpncheck '${A} ${B} jsonobj,a,b ${B} ${A} jsonobj,b,a' '"{"a":3,"b":4}" "{"b":4,"a":3}"'
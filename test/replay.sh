@@ -0,0 +1,24 @@
+#!/bin/sh
+# rpnreplay: timers and wall time on the virtual clock
+. test/lib.inc
+
+result=$(printf '%s\n' time,x 0,0 10,1 12,0 20,1 100,0 | ./rpnreplay '${x} 5 ondelay')
+expect ondelay "$result" "0.000,out,0
+25.000,out,1
+100.000,out,0"
+
+# wakeups align with the interval, as with libt
+result=$(printf '%s\n' time,x 5,1 100,2 250,3 | ./rpnreplay -a '${x} pop 60 wakeup2')
+expect wakeup "$result" "5.000,out,0
+60.010,out,1
+100.000,out,0
+120.010,out,1
+180.010,out,1
+240.010,out,1
+250.000,out,0"
+
+# a line that goes back in time is skipped
+result=$(printf '%s\n' time,x 0,1 10,2 5,3 20,4 | ./rpnreplay '${x}' 2>/dev/null)
+expect "time back" "$result" "0.000,out,1
+10.000,out,2
+20.000,out,4"
@@ -0,0 +1,49 @@
+#!/bin/sh
+# ravg, rmin & rmax against a brute force computation
+. test/lib.inc
+
+input=$(awk 'BEGIN {
+	srand(3)
+	print "time,x"
+	for (j = 0; j < 3000; ++j)
+		printf "%i,%i\n", j*10 + int(rand()*5), int(rand()*1000) - 500
+}')
+
+# the window holds the samples after now - period,
+# and the last one before
+brute() {
+	awk -v period=$1 'BEGIN { FS = ","; n = 0 }
+	NR > 1 {
+		t[n] = $1; v[n] = $2; n++
+		for (h = n-1; h > 0 && t[h] > $1 - period; --h);
+		mn = mx = v[h]; sum = 0
+		for (k = h; k < n; ++k) {
+			if (v[k] < mn)
+				mn = v[k]
+			if (v[k] > mx)
+				mx = v[k]
+			if (k+1 < n)
+				sum += v[k] * (t[k+1] - t[k])
+		}
+		avg = (n-1 > h) ? sprintf("%g", sum / (t[n-1] - t[h])) : "null"
+		printf "%i.000,out,{\"min\":%i,\"max\":%i,\"avg\":%s}\n", $1, mn, mx, avg
+	}'
+}
+
+# 2nd period grows the window table a few times
+for period in 300 1000; do
+	result=$(echo "$input" | ./rpnreplay -a "\${x} $period rmin \${x} $period rmax \${x} $period ravg jsonobj,min,max,avg")
+	expect "period $period" "$result" "$(echo "$input" | brute $period)"
+done
+
+# within a budget, buckets keep the sum, min & max exact
+# as long as no sample leaves the window
+logic='${x} 1e6 rmin ${x} 1e6 rmax ${x} 1e6 ravg jsonobj,min,max,avg'
+result=$(echo "$input" | ./rpnreplay -a "$(echo "$logic" | sed 's/\(rm..\|ravg\)/\1,16/g')")
+expect "budget 16" "$result" "$(echo "$input" | ./rpnreplay -a "$logic")"
+
+for budget in '' abc -5 7 100.5 1e9; do
+	rpnrefused "1 10 ravg,$budget"
+done
+rpncheck '1 10 ravg,8' ''
+rpnrefused "1 10 rmedian,abc"
@@ -0,0 +1,18 @@
+#!/bin/sh
+# cached results of pure segments, invalidated per topic
+. test/lib.inc
+
+sigcheck '${x} 2 * ${y} 3 * +' 'seg2>13 seg0>6 x/0/1/0 0x1p+1 */2/1/0 end0 seg1>11 y/0/1/0 0x1.8p+1 */2/1/0 end1 +/2/1/0 end2'
+# the rest depends on time
+sigcheck '${x} 2 * timeofday +' 'seg0>5 x/0/1/0 0x1p+1 */2/1/0 end0 timeofday/0/1/0 +/2/1/0'
+sigcheck '${x} 10 ago 2 *' 'x/0/1/0 0x1.4p+3 ago/2/1/0 0x1p+1 */2/1/0'
+
+# a new value invalidates only its own segments
+result=$(printf '%s\n' time,x,y 0,1,1 1,2, 2,,5 3,2,5 4,3, 5,,7 |
+	./rpnreplay -a '${x} 2 * ${y} 3 * +')
+expect replay "$result" "0.000,out,
+0.000,out,5
+1.000,out,7
+2.000,out,19
+4.000,out,21
+5.000,out,27"
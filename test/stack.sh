@@ -0,0 +1,15 @@
+#!/bin/sh
+# stack depth verification: checked operators only where needed
+. test/lib.inc
+export A=3 Z=0
+
+rpncheck '1 +' failed
+rpncheck 'pop' failed
+# underflow on 1 path only
+rpncheck '${A} if 1 fi +' failed
+rpncheck '${A} if 1 2 fi +' 3
+rpncheck '${Z} if 1 2 fi +' failed
+rpncheck '${A} if 1 else 1 2 fi +' failed
+rpncheck '${Z} if 1 else 1 2 fi +' 3
+# the stack is reserved for the deepest path
+rpncheck "$(seq 1 100 | tr '\n' ' ')$(yes + | head -99 | tr '\n' ' ')" 5050
@@ -0,0 +1,16 @@
+#!/bin/sh
+# string arena: strings of 1 evaluation stay valid until the next
+. test/lib.inc
+export A=7
+
+# 100 strings of 101 bytes span several chunks
+logic=$(yes '${A} "%0100.0f" printf' | head -n 100 | tr '\n' ' ')
+expect "100 strings" "$(./rpntest "$logic" | tr ' ' '\n' | sort | uniq -c | awk '{ print $1, length($2) }')" "100 102"
+# a string larger than a chunk
+expect "large string" "$(./rpntest '${A} "%05000.0f" printf ${A} "x%.0fy" printf' | awk '{ print length($1), $2 }')" '5002 "x7y"'
+# chunks are reused by the next evaluations
+result=$(printf '%s\n' time,A 0,1 1,22 2,333 |
+	./rpnreplay -a '${A} "%05000.0f" printf pop ${A} "<%.0f>" printf')
+expect "reuse" "$result" "0.000,out,<1>
+1.000,out,<22>
+2.000,out,<333>"
@@ -0,0 +1,10 @@
+#!/bin/sh
+# sun3 & azimuth3 are pure: folded or not, the result is the same
+. test/lib.inc
+export T=1720691618 T2=1720691918
+
+rpncheck '1720691618 52 4 sun3 1720691618 52 4 azimuth3' '52.7595 132.485'
+rpncheck '${T} 52 4 sun3 ${T} 52 4 azimuth3' '52.7595 132.485'
+# 5 minutes later, after the above
+rpncheck '${T} 52 4 sun3 ${T2} 52 4 sun3' '52.7595 53.3189'
+rpncheck '1720691918 52 4 sun3' '53.3189'
@@ -0,0 +1,18 @@
+#!/bin/sh
+# sunabove flips at the crossings, also when the sun just dips
+# below the elevation, near the polar day
+T0=1720691618
+
+result=$( (echo time,x; for i in $(seq 0 24); do echo "$((T0 + i*3600)),$i"; done) |
+	./rpnreplay '78 0 10 sunabove')
+expected="$T0.000,out,1
+1720742063.000,out,0
+1720743377.000,out,1"
+
+if [ "$result" != "$expected" ]; then
+	echo "got:"
+	echo "$result"
+	echo "expected:"
+	echo "$expected"
+	exit 1
+fi
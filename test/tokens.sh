@@ -0,0 +1,24 @@
+#!/bin/sh
+# splitting logic into tokens
+. test/lib.inc
+
+# spaces between quotes don't separate, spaces & tabs elsewhere do
+rpncheck '"a b  c" "d"' '"a b  c" "d"'
+rpncheck '  1 	 2   +  ' '3'
+rpncheck '"" "say \"hi\""' '"" "say \"hi\""'
+# an unterminated string runs to the end
+rpncheck '"abc' '"abc"'
+# numbers with units
+rpncheck '1m 2h' '60 7200'
+# topics
+export A=4
+rpncheck '${A} 1 +' '5'
+rpncheck '5 ={X}' "={X} '5'"
+# operator arguments after ','
+rpncheck '1 2 jsonobj,a,b' '"{"a":1,"b":2}"'
+# logic in several pieces
+expect append "$(./rpntest '${A}' '2 +')" '6'
+
+rpnrefused '1 foo +'
+rpnrefused '${A}2'
+rpnrefused '1,2'
@@ -0,0 +1,170 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vlibt.h"
+
+struct timer {
+	struct timer *next;
+	void (*fn)(void *dat);
+	void *dat;
+	double wakeup;
+};
+
+static struct timer *timers;
+static double vnow;
+
+/* clock */
+double libt_now(void)
+{
+	return vnow;
+}
+
+double libt_walltime(void)
+{
+	return vnow;
+}
+
+void vlibt_set_now(double now)
+{
+	vnow = now;
+}
+
+/* timer list, sorted on wakeup */
+static struct timer **t_find(void (*fn)(void *), const void *dat)
+{
+	struct timer **pt;
+
+	for (pt = &timers; *pt; pt = &(*pt)->next) {
+		if ((*pt)->fn == fn && (*pt)->dat == dat)
+			break;
+	}
+	return pt;
+}
+
+static void t_add_sorted(struct timer *t)
+{
+	struct timer **pt;
+
+	for (pt = &timers; *pt; pt = &(*pt)->next) {
+		if (t->wakeup < (*pt)->wakeup)
+			break;
+	}
+	t->next = *pt;
+	*pt = t;
+}
+
+void libt_add_timeouta(double wakeuptime, void (*fn)(void *), const void *dat)
+{
+	struct timer **pt, *t;
+
+	if (isnan(wakeuptime))
+		return;
+	pt = t_find(fn, dat);
+	t = *pt;
+	if (t) {
+		*pt = t->next;
+	} else {
+		t = malloc(sizeof(*t));
+		if (!t)
+			abort();
+		t->fn = fn;
+		t->dat = (void *)dat;
+	}
+	t->wakeup = wakeuptime;
+	t_add_sorted(t);
+}
+
+void libt_add_timeout(double timeout, void (*fn)(void *), const void *dat)
+{
+	if (isnan(timeout))
+		return;
+	libt_add_timeouta(timeout+vnow, fn, dat);
+}
+
+void libt_repeat_timeout(double increment, void (*fn)(void *), const void *dat)
+{
+	struct timer *t;
+	double wakeup;
+
+	if (isnan(increment))
+		return;
+	t = *t_find(fn, dat);
+	if (!t) {
+		libt_add_timeout(increment, fn, dat);
+		return;
+	}
+	wakeup = t->wakeup + increment;
+	if (wakeup < vnow)
+		/* mimic libt: don't catch up in the past */
+		wakeup = vnow + increment;
+	libt_add_timeouta(wakeup, fn, dat);
+}
+
+void libt_remove_timeout(void (*fn)(void *), const void *dat)
+{
+	struct timer **pt, *t;
+
+	pt = t_find(fn, dat);
+	t = *pt;
+	if (t) {
+		*pt = t->next;
+		free(t);
+	}
+}
+
+int libt_timeout_exist(void (*fn)(void *), const void *dat)
+{
+	return !!*t_find(fn, dat);
+}
+
+int vlibt_run_until(double now)
+{
+	struct timer *t;
+	void (*fn)(void *);
+	void *dat;
+	int cnt;
+
+	for (cnt = 0; timers && timers->wakeup <= now; ++cnt) {
+		t = timers;
+		timers = t->next;
+		if (t->wakeup > vnow)
+			vnow = t->wakeup;
+		fn = t->fn;
+		dat = t->dat;
+		/* remove first, the callback may re-arm */
+		free(t);
+		fn(dat);
+	}
+	if (now > vnow)
+		vnow = now;
+	return cnt;
+}
+
+int libt_flush(void)
+{
+	return vlibt_run_until(vnow);
+}
+
+double libt_next_wakeup(void)
+{
+	return timers ? timers->wakeup : -1;
+}
+
+int libt_get_waittime(void)
+{
+	/* virtual time does not wait */
+	return timers ? 0 : -1;
+}
+
+void libt_cleanup(void)
+{
+	struct timer *t;
+
+	while (timers) {
+		t = timers;
+		timers = t->next;
+		free(t);
+	}
+}
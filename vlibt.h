@@ -0,0 +1,24 @@
+#ifndef _vlibt_h_
+#define _vlibt_h_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* libt on a virtual clock
+ * Link vlibt.o instead of lib/libt.o to replay recorded input.
+ * libt_now() and libt_walltime() both return the virtual time.
+ */
+#include "lib/libt.h"
+
+/* set the virtual clock, without running timeouts */
+extern void vlibt_set_now(double now);
+
+/* run all timeouts until @now, in order, with the clock
+ * set to each timeout's wakeup time. The clock ends at @now.
+ */
+extern int vlibt_run_until(double now);
+
+#ifdef __cplusplus
+}
+#endif
+#endif